@@ -15,8 +15,16 @@
 //    - That it appears at the end of the name
 //
 // To compile, use any of:
-//    make nwnltr
-//    cc -o nwnltr nwnltr.c
+//    make nwnltr LDLIBS=-pthread
+//    cc -o nwnltr nwnltr.c -pthread
+//
+// To embed the generator in another program, compile with -DNWNLTR_NO_MAIN
+// and use load_ltr(), fix_ltr(), build_sampler() or build_compact() and
+// ltr_generate(), or
+// ltr_registry_load() and ltr_registry_find() to keep a whole directory of
+// tables loaded. To compile tables into the program instead of loading them,
+// write them out with --emit-c and build with -DNWNLTR_EMBEDDED='"FILE"',
+// then use ltr_registry_load_embedded().
 //
 #include "stdio.h"
 #include "stdint.h"
@@ -25,23 +33,74 @@
 #include "string.h"
 #include "ctype.h"
 #include "time.h"
+#include "pthread.h"
+#include "dirent.h"
+#include "strings.h"
+#ifndef _WIN32
+#include "fcntl.h"
+#include "unistd.h"
+#include "sys/mman.h"
+#include "sys/stat.h"
+#else
+#include "malloc.h"
+#endif
 
 #define HELP \
 "NWN name generator tool\n" \
 "Usage: nwnltr [OPTION] <LTRFILE>\n" \
+"       nwnltr [OPTION] -t NAME <DIRECTORY>\n" \
+"       nwnltr --emit-c <DIRECTORY> > FILE\n" \
 "Options:\n" \
 " -p, --print         Print Markov chain tables for <LTRFILE> in a human readable format\n" \
 " -b, --build         Build Markov chain tables using words from stdin and store in <LTRFILE>\n" \
+" -i, --input=FILE    Read the words for --build from FILE instead of stdin\n" \
+" -c, --counts        With --build, also store the raw letter counts in <LTRFILE>.cnt\n" \
+"                     (foo.cnt for foo.ltr), so the tables can be updated later\n" \
+" -U, --update        Add the words from stdin (or --input) to <LTRFILE>.cnt, then\n" \
+"                     rebuild <LTRFILE> and rewrite <LTRFILE>.cnt from the new counts\n" \
+" -m, --merge CNT...  Sum the given counts files (plus any --build/--update words),\n" \
+"                     and write <LTRFILE> and <LTRFILE>.cnt from the result\n" \
 " -g, --generate=NUM  Generate NUM names from <LTRFILE> and print to stdout. NUM=100 by default\n" \
 " -s, --seed=NUM      Set the RNG seed to NUM. time(NULL) by default\n" \
-" -n, --nofix         Do not fix corrupted tables in ltr files (if detected). default is to fix\n"
+" -n, --nofix         Do not fix corrupted tables in ltr files (if detected). default is to fix\n" \
+" -e, --game-exact    Generate names with the game's exact algorithm, giving identical output\n" \
+"                     for a given seed. default is a faster, statistically similar sampler.\n" \
+"                     Implies --rng=libc unless another RNG is given\n" \
+" -r, --rng=NAME      Random number generator: xoshiro (default), pcg, or libc (the game's rand())\n" \
+" -j, --jobs=NUM      Generate names on NUM threads. Each thread has its own RNG stream derived\n" \
+"                     from the seed, so output is the same for a given seed and NUM.\n" \
+"                     With --build, count the input words on NUM threads\n" \
+" -t, --table=NAME    Load all the .ltr files in <DIRECTORY> and use NAME.ltr from it\n" \
+" -u, --unique        Only generate distinct names (compared case insensitively)\n" \
+" -x, --exclude=FILE  Never generate any of the names listed in FILE, one per line\n" \
+"     --stats         Print build and generation counters (skipped characters and names,\n" \
+"                     draws, backoffs, restarts, bailouts) to stderr as key=value pairs\n" \
+"     --bench         Time loading, generating (-g NUM names, 100000 by default) and\n" \
+"                     building <LTRFILE>, or each .ltr file in <DIRECTORY>\n" \
+"     --emit-c        Print the tables of all the .ltr files in <DIRECTORY> as C source,\n" \
+"                     fixed unless -n is given. Compile that in with\n" \
+"                     -DNWNLTR_EMBEDDED='\"FILE\"' and use it with -t NAME -\n"
 
 struct cfg {
     int   build;
     int   print;
     int   nofix;
+    int   game_exact;
     int   generate;
     int   seed;
+    int   jobs;
+    int   unique;
+    int   stats;
+    int   bench;
+    int   emit_c;
+    char *exclude;
+    char *input;
+    int   counts;
+    int   update;
+    int   nmerge;
+    char **merge;
+    char *rng;
+    char *table;
     char *ltrfile;
 } cfg;
 
@@ -62,9 +121,51 @@ void parse_cmdline(int argc, char *argv[]) {
         cfg.print |= !strcmp(argv[i], "-p") || !strcmp(argv[i], "--print");
         cfg.build |= !strcmp(argv[i], "-b") || !strcmp(argv[i], "--build");
         cfg.nofix |= !strcmp(argv[i], "-n") || !strcmp(argv[i], "--nofix");
+        cfg.game_exact |= !strcmp(argv[i], "-e") || !strcmp(argv[i], "--game-exact");
 
         sscanf(argv[i], "--seed=%d", &cfg.seed) || (!strcmp(argv[i], "-s") && sscanf(argv[i+1], "%d", &cfg.seed));
 
+        if (!strncmp(argv[i], "--jobs=", 7) || !strcmp(argv[i], "-j")) {
+            const char *n = argv[i][1] == 'j' ? (i + 1 < argc - 1 ? argv[++i] : "") : argv[i] + 7;
+            if (sscanf(n, "%d", &cfg.jobs) != 1 || cfg.jobs < 1)
+                die("Bad argument - Need number of jobs with -j / --jobs");
+        }
+
+        cfg.unique |= !strcmp(argv[i], "-u") || !strcmp(argv[i], "--unique");
+        cfg.stats |= !strcmp(argv[i], "--stats");
+        cfg.bench |= !strcmp(argv[i], "--bench");
+        cfg.emit_c |= !strcmp(argv[i], "--emit-c");
+        cfg.counts |= !strcmp(argv[i], "-c") || !strcmp(argv[i], "--counts");
+        cfg.update |= !strcmp(argv[i], "-U") || !strcmp(argv[i], "--update");
+
+        if (!strcmp(argv[i], "-m") || !strcmp(argv[i], "--merge")) {
+            cfg.merge = &argv[i+1];
+            while (i+1 < argc-1 && argv[i+1][0] != '-')
+                cfg.nmerge++, i++;
+            if (!cfg.nmerge)
+                die("--merge needs at least one counts file");
+        }
+
+        if (!strncmp(argv[i], "--input=", 8))
+            cfg.input = argv[i] + 8;
+        else if (!strcmp(argv[i], "-i"))
+            cfg.input = argv[++i];
+
+        if (!strncmp(argv[i], "--exclude=", 10))
+            cfg.exclude = argv[i] + 10;
+        else if (!strcmp(argv[i], "-x"))
+            cfg.exclude = argv[++i];
+
+        if (!strncmp(argv[i], "--table=", 8))
+            cfg.table = argv[i] + 8;
+        else if (!strcmp(argv[i], "-t"))
+            cfg.table = argv[++i];
+
+        if (!strncmp(argv[i], "--rng=", 6))
+            cfg.rng = argv[i] + 6;
+        else if (!strcmp(argv[i], "-r"))
+            cfg.rng = argv[++i];
+
         if (sscanf(argv[i], "--generate=%d", &cfg.generate) != 1) {
             if (!strcmp(argv[i], "--generate"))
                 cfg.generate = 100;
@@ -74,8 +175,8 @@ void parse_cmdline(int argc, char *argv[]) {
     }
 
     cfg.ltrfile = argv[argc-1];
-    if (!(cfg.print || cfg.build || cfg.generate)) {
-        printf("Need at least one of -p, -b, -g\n" HELP);
+    if (!(cfg.print || cfg.build || cfg.update || cfg.nmerge || cfg.generate || cfg.bench || cfg.emit_c)) {
+        printf("Need at least one of -p, -b, -U, -m, -g, --bench, --emit-c\n" HELP);
         exit(0);
     }
 }
@@ -103,12 +204,164 @@ struct ltrdata {
     struct cdf doubles[NUM_LETTERS];
     struct cdf triples[NUM_LETTERS][NUM_LETTERS];
 };
+// Walker alias table for constant time sampling from one CDF. Outcome
+// NUM_LETTERS stands for the probability mass not covered by the CDF, which
+// makes the game's linear scan fall off the end of the table.
+#define ALIAS_OUTCOMES (NUM_LETTERS + 1)
+struct alias {
+    float   prob[ALIAS_OUTCOMES];
+    uint8_t alias[ALIAS_OUTCOMES];
+};
+struct alias_cdf {
+    struct alias start;
+    struct alias middle;
+    struct alias end;
+};
+struct ltr_sampler {
+    struct alias_cdf singles;
+    struct alias_cdf doubles[NUM_LETTERS];
+    struct alias_cdf triples[NUM_LETTERS][NUM_LETTERS];
+    uint8_t live[NUM_LETTERS][NUM_LETTERS]; // Contexts from which a name can end
+    int dead; // Contexts that can be entered but never lead to an end
+};
+// The runtime copies of the tables below number their CDFs by context: the
+// singles, then doubles[a], then triples[a][b]
+#define NUM_CONTEXTS (1 + NUM_LETTERS + NUM_LETTERS * NUM_LETTERS)
+#define CTX_SINGLES       0
+#define CTX_DOUBLES(a)    (1 + (a))
+#define CTX_TRIPLES(a, b) (1 + NUM_LETTERS + (a) * NUM_LETTERS + (b))
+// Compact copy of the tables for the exact algorithm, holding only the
+// nonzero entries of each CDF. Zeros can never be the first entry above the
+// random number, so scanning these gives the same letter as scanning the
+// full table. Each context has its start, middle and end entries back to
+// back from offset in letters/values.
+struct sparse_cdf {
+    uint32_t offset;
+    uint8_t  count[3];
+};
+struct ltr_compact {
+    struct sparse_cdf contexts[NUM_CONTEXTS];
+    const uint8_t *letters;
+    const float   *values;
+    size_t         size;
+};
+// Copy of the tables for the exact algorithm with each CDF padded to
+// CDF_PAD floats and aligned to them, so that cdf_find() can compare a whole
+// CDF at once with SIMD instructions. The padding is -1, which no random
+// number is below.
+#define CDF_PAD 32
+struct padded_cdf {
+    float part[3][CDF_PAD];
+};
+struct ltr_padded {
+    struct padded_cdf contexts[NUM_CONTEXTS];
+};
 struct ltrfile {
     struct ltr_header header;
     struct ltrdata data;
+    struct ltr_sampler *sampler;       // Built by build_sampler(), not part of the file
+    const struct ltr_compact *compact; // Built by build_compact(), not part of the file
+    struct ltr_padded  *padded;        // Built by build_padded(), not part of the file
+};
+
+// Random number generators. The libc one is what the game uses, and needs
+// to be used with --game-exact to reproduce its names. It is global state,
+// so not thread safe. The others keep all of their state in struct rng_state.
+enum rng_kind { RNG_XOSHIRO, RNG_PCG, RNG_LIBC };
+const char *const rng_names[] = { "xoshiro", "pcg", "libc" };
+// Counters kept by ltr_generate() for --stats. They live in the rng state,
+// as that is the only thing each caller (or thread) has to itself.
+struct ltr_stats {
+    uint64_t names;
+    uint64_t draws;    // Random numbers drawn to pick letters
+    uint64_t restarts; // Names thrown away and started over, for any reason
+    uint64_t bailouts; // Restarts after more than 100 backoffs in one name
+    uint64_t backoffs; // Failed middle letters, undone by dropping a letter
+};
+struct rng_state {
+    enum rng_kind kind;
+    uint64_t s[4];
+    struct ltr_stats stats;
 };
 
-static float nrand() { return (float)rand() / RAND_MAX; }
+static uint64_t splitmix64(uint64_t *x) {
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+void rng_seed(struct rng_state *rng, enum rng_kind kind, uint64_t seed) {
+    rng->kind = kind;
+    memset(&rng->stats, 0, sizeof(rng->stats));
+    if (kind == RNG_LIBC) {
+        srand(seed);
+        return;
+    }
+    for (int i = 0; i < 4; i++)
+        rng->s[i] = splitmix64(&seed);
+    if (kind == RNG_PCG)
+        rng->s[1] |= 1; // stream increment must be odd
+}
+
+static inline uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+static inline uint32_t rng_next(struct rng_state *rng);
+
+// Moves rng to independent stream number 'stream' of its seed: for xoshiro
+// that is 'stream' jumps of 2^128 steps, for pcg a different increment.
+void rng_stream(struct rng_state *rng, uint64_t stream) {
+    static const uint64_t jump[] = { 0x180ec6d33cfd0aba, 0xd5a61266f0c9392c, 0xa9582618e03fc9aa, 0x39abdc4529b1661c };
+    if (rng->kind == RNG_PCG) {
+        rng->s[1] = (splitmix64(&stream) << 1) | 1;
+    } else if (rng->kind == RNG_XOSHIRO) {
+        while (stream--) {
+            uint64_t t[4] = {0};
+            for (int i = 0; i < 4; i++) {
+                for (int b = 0; b < 64; b++) {
+                    if (jump[i] & (1ull << b)) {
+                        for (int k = 0; k < 4; k++)
+                            t[k] ^= rng->s[k];
+                    }
+                    rng_next(rng);
+                }
+            }
+            memcpy(rng->s, t, sizeof(t));
+        }
+    }
+}
+
+// Returns 32 random bits
+static inline uint32_t rng_next(struct rng_state *rng) {
+    uint64_t *s = rng->s;
+    if (rng->kind == RNG_XOSHIRO) { // xoshiro256**
+        uint64_t result = rotl(s[1] * 5, 7) * 9, t = s[1] << 17;
+        s[2] ^= s[0]; s[3] ^= s[1]; s[1] ^= s[2]; s[0] ^= s[3];
+        s[2] ^= t;
+        s[3] = rotl(s[3], 45);
+        return result >> 32;
+    } else { // pcg32 (XSH RR)
+        uint64_t old = s[0];
+        s[0] = old * 6364136223846793005ull + s[1];
+        uint32_t xorshifted = ((old >> 18) ^ old) >> 27, rot = old >> 59;
+        return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+    }
+}
+
+// Uniform float in [0, 1), or [0, 1] for libc, where rand() can return
+// RAND_MAX; alias_draw() clamps that case
+static inline float rng_float(struct rng_state *rng) {
+    if (rng->kind == RNG_LIBC)
+        return (float)rand() / RAND_MAX;
+    return (rng_next(rng) >> 8) * (1.0f / 16777216.0f);
+}
+
+// Uniform integer in [0, n)
+static inline int rng_below(struct rng_state *rng, int n) {
+    if (rng->kind == RNG_LIBC)
+        return rand() % n;
+    return ((uint64_t)rng_next(rng) * n) >> 32;
+}
+
 static int idx(char letter) {
     if (letter == '\'') return 26;
     if (letter == '-')  return 27;
@@ -206,124 +459,267 @@ void fix_ltr(struct ltrfile *ltr) {
     }
 }
 
-void build_ltr(const char *filename, struct ltrfile *ltr) {
+// Raw letter sequence counts collected while building a table. These are
+// integers so that large corpora don't lose precision as floats would past
+// 2^24, and can be counted in parallel and summed.
+struct cdf_counts {
+    uint64_t start  [NUM_LETTERS];
+    uint64_t middle [NUM_LETTERS];
+    uint64_t end    [NUM_LETTERS];
+};
+struct ltrcounts {
+    struct cdf_counts singles;
+    struct cdf_counts doubles[NUM_LETTERS];
+    struct cdf_counts triples[NUM_LETTERS][NUM_LETTERS];
+};
+// Counters kept while counting names for --stats. Not part of ltrcounts, so
+// that counts files stay the same.
+struct build_stats {
+    uint64_t names;         // Names counted
+    uint64_t invalid_chars; // Characters not in the table, skipped
+    uint64_t short_names;   // Names under 3 letters, skipped
+};
+
+static void count_name(struct ltrcounts *c, struct build_stats *stats, const char *name, size_t len) {
+    char buf2[256] = {0};
+    char *p = buf2, *q = buf2;
+    for (size_t i = 0; i < len; i++) {
+        char r = name[i];
+        if (r == '#') // stop on # to allow comments
+            break;
+        r = tolower((uint8_t)r);
+        if (idx(r) == -1) {
+            fprintf(stderr, "Invalid character %c (%02x) in name \"%.*s\". Skipping character.\n", r, (uint8_t)r, (int)len, name);
+            stats->invalid_chars++;
+            continue;
+        }
+        *q++ = r;
+    }
+    *q = '\0';
+
+    if ((q - buf2) < 3) { // we need at least 3 characters in a name
+        fprintf(stderr, "Name \"%s\" is too short. Skipping name.\n", buf2);
+        stats->short_names++;
+        return;
+    }
+    stats->names++;
+
+    q--;
+
+    c->singles.start[idx(p[0])]++;
+    c->doubles[idx(p[0])].start[idx(p[1])]++;
+    c->triples[idx(p[0])][idx(p[1])].start[idx(p[2])]++;
+
+    c->singles.end[idx(q[0])]++;
+    c->doubles[idx(q[-1])].end[idx(q[0])]++;
+    c->triples[idx(q[-2])][idx(q[-1])].end[idx(q[0])]++;
+
+    if ((q - p) == 2) return; // No middle
+    while (++p != q-2) {
+        c->singles.middle[idx(p[0])]++;
+        c->doubles[idx(p[0])].middle[idx(p[1])]++;
+        c->triples[idx(p[0])][idx(p[1])].middle[idx(p[2])]++;
+    }
+}
+
+// Counts all whitespace separated names in [p, end). As with scanf("%255s"),
+// words longer than 255 characters are split.
+void count_names(struct ltrcounts *c, struct build_stats *stats, const char *p, const char *end) {
+    while (p < end) {
+        while (p < end && isspace((uint8_t)*p))
+            p++;
+        const char *word = p;
+        while (p < end && !isspace((uint8_t)*p) && p - word < 255)
+            p++;
+        if (p > word)
+            count_name(c, stats, word, p - word);
+    }
+}
+
+void add_counts(struct ltrcounts *dst, const struct ltrcounts *src) {
+    uint64_t *d = (uint64_t *)dst;
+    const uint64_t *s = (const uint64_t *)src;
+    for (size_t i = 0; i < sizeof(*dst) / sizeof(uint64_t); i++)
+        d[i] += s[i];
+}
+
+static void normalize(float *cdf, const uint64_t *counts) {
+    uint64_t total = 0;
+    float acc = 0.0;
+    for (int i = 0; i < NUM_LETTERS; i++)
+        total += counts[i];
+    for (int i = 0; i < NUM_LETTERS; i++) {
+        cdf[i] = 0.0;
+        if (counts[i] > 0) {
+            cdf[i] = (float)counts[i] / (float)total;
+            acc = cdf[i] += acc;
+        }
+    }
+}
+
+static void normalize_cdf(struct cdf *cdf, const struct cdf_counts *counts) {
+    normalize(cdf->start,  counts->start);
+    normalize(cdf->middle, counts->middle);
+    normalize(cdf->end,    counts->end);
+}
+
+// Turns the counts into the CDF tables of a new ltr file
+void ltr_from_counts(struct ltrfile *ltr, const struct ltrcounts *c) {
     memset(ltr, 0, sizeof(*ltr));
     strncpy(ltr->header.magic, "LTR V1.0", 8);
     ltr->header.num_letters = NUM_LETTERS;
 
-    char buf[256] = {0};
-    while (scanf("%255s", buf) == 1) {
-        char buf2[256] = {0};
-        char *p = buf2, *q = buf2;
-        for (char *r = buf; *r; r++) {
-            if ((*r) == '#') // stop on # to allow comments
-                break;
-            *r = tolower(*r);
-            if (idx(*r) == -1) {
-                fprintf(stderr, "Invalid character %c (%02x) in name \"%s\". Skipping character.\n", *r, (uint8_t)*r, buf);
-                fflush(stderr);
-                continue;
-            }
-            *q++ = *r;
-        }
-        *q = '\0';
+    normalize_cdf(&ltr->data.singles, &c->singles);
+    for (int i = 0; i < NUM_LETTERS; i++) {
+        normalize_cdf(&ltr->data.doubles[i], &c->doubles[i]);
+        for (int j = 0; j < NUM_LETTERS; j++)
+            normalize_cdf(&ltr->data.triples[i][j], &c->triples[i][j]);
+    }
+}
 
-        if ((q - buf2) < 3) { // we need at least 3 characters in a name
-            fprintf(stderr, "Name \"%s\" is too short. Skipping name.\n", buf2);
-            fflush(stderr);
-            continue;
+// Maps all of filename into memory where possible. Returns NULL if it can't
+// be mapped (stdin, pipes, Windows); release with unmap_input().
+const char *map_input(const char *filename, size_t *len) {
+#ifndef _WIN32
+    if (filename) {
+        int fd = open(filename, O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st))
+            die("Unable to open file %s", filename);
+        *len = st.st_size;
+        void *map = *len ? mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+        close(fd);
+        if (map != MAP_FAILED) {
+            madvise(map, *len, MADV_SEQUENTIAL);
+            return map;
         }
+    }
+#endif
+    (void)filename;
+    (void)len;
+    return NULL;
+}
+
+void unmap_input(const char *buf, size_t len) {
+#ifndef _WIN32
+    munmap((void *)buf, len);
+#endif
+    (void)buf;
+    (void)len;
+}
 
-        q--;
+struct countjob {
+    struct ltrcounts *counts;
+    struct build_stats stats;
+    const char *start;
+    const char *end;
+};
 
-        ltr->data.singles.start[idx(p[0])]                       += 1.0;
-        ltr->data.doubles[idx(p[0])].start[idx(p[1])]            += 1.0;
-        ltr->data.triples[idx(p[0])][idx(p[1])].start[idx(p[2])] += 1.0;
+static void *count_worker(void *arg) {
+    struct countjob *job = arg;
+    count_names(job->counts, &job->stats, job->start, job->end);
+    return NULL;
+}
 
-        ltr->data.singles.end[idx(q[0])]                         += 1.0;
-        ltr->data.doubles[idx(q[-1])].end[idx(q[0])]             += 1.0;
-        ltr->data.triples[idx(q[-2])][idx(q[-1])].end[idx(q[0])] += 1.0;
+// Counts the names in buf on nthreads threads, each on a slice of the input
+// split at whitespace, and sums their counts into c and their counters into stats.
+void count_names_parallel(struct ltrcounts *c, struct build_stats *stats, const char *buf, size_t len, int nthreads) {
+    struct countjob *jobs = calloc(nthreads, sizeof(*jobs));
+    pthread_t *threads = calloc(nthreads, sizeof(*threads));
+    if (!jobs || !threads)
+        die("Out of memory");
 
-        if ((q - p) == 2) continue; // No middle
-        while (++p != q-2) {
-            ltr->data.singles.middle[idx(p[0])]                       += 1.0;
-            ltr->data.doubles[idx(p[0])].middle[idx(p[1])]            += 1.0;
-            ltr->data.triples[idx(p[0])][idx(p[1])].middle[idx(p[2])] += 1.0;
-        }
+    const char *p = buf, *end = buf + len;
+    for (int t = 0; t < nthreads; t++) {
+        const char *split = (t == nthreads - 1) ? end : buf + len / nthreads * (t + 1);
+        if (split < p)
+            split = p;
+        while (split < end && !isspace((uint8_t)*split))
+            split++;
+        jobs[t].start = p;
+        jobs[t].end = p = split;
+        jobs[t].counts = t ? calloc(1, sizeof(struct ltrcounts)) : c;
+        if (!jobs[t].counts)
+            die("Out of memory");
+        if (pthread_create(&threads[t], NULL, count_worker, &jobs[t]))
+            die("Unable to create thread");
     }
 
-    {
-        float s = 0.0, m = 0.0, e = 0.0;
-        int startcount = 0, midcount = 0, endcount = 0;
-        for (int i = 0; i < ltr->header.num_letters; i++) {
-            startcount += (int)ltr->data.singles.start[i];
-            endcount += (int)ltr->data.singles.end[i];
-            midcount += (int)ltr->data.singles.middle[i];
-        }
-        for (int i = 0; i < ltr->header.num_letters; i++) {
-            if (ltr->data.singles.start[i] > 0.0) {
-                ltr->data.singles.start[i] /= (float)startcount;
-                s = ltr->data.singles.start[i] += s;
-            }
-            if (ltr->data.singles.end[i] > 0.0) {
-                ltr->data.singles.end[i] /= (float)endcount;
-                e = ltr->data.singles.end[i] += e;
-            }
-            if (ltr->data.singles.middle[i] > 0.0) {
-                ltr->data.singles.middle[i] /= (float)midcount;
-                m = ltr->data.singles.middle[i] += m;
-            }
+    for (int t = 0; t < nthreads; t++) {
+        pthread_join(threads[t], NULL);
+        stats->names         += jobs[t].stats.names;
+        stats->invalid_chars += jobs[t].stats.invalid_chars;
+        stats->short_names   += jobs[t].stats.short_names;
+        if (t) {
+            add_counts(c, jobs[t].counts);
+            free(jobs[t].counts);
         }
     }
-    for (int i = 0; i < ltr->header.num_letters; i++) {
-        float s = 0.0, m = 0.0, e = 0.0;
-        int startcount = 0, midcount = 0, endcount = 0;
-        for (int j = 0; j < ltr->header.num_letters; j++) {
-            startcount += (int)ltr->data.doubles[i].start[j];
-            endcount += (int)ltr->data.doubles[i].end[j];
-            midcount += (int)ltr->data.doubles[i].middle[j];
-        }
-        for (int j = 0; j < ltr->header.num_letters; j++) {
-            if (ltr->data.doubles[i].start[j] > 0.0) {
-                ltr->data.doubles[i].start[j] /= (float)startcount;
-                s = ltr->data.doubles[i].start[j] += s;
-            }
-            if (ltr->data.doubles[i].end[j] > 0.0) {
-                ltr->data.doubles[i].end[j] /= (float)endcount;
-                e = ltr->data.doubles[i].end[j] += e;
-            }
-            if (ltr->data.doubles[i].middle[j] > 0.0) {
-                ltr->data.doubles[i].middle[j] /= (float)midcount;
-                m = ltr->data.doubles[i].middle[j] += m;
-            }
-        }
+    free(jobs);
+    free(threads);
+}
+
+static void count_block(struct ltrcounts *c, struct build_stats *stats, const char *buf, size_t len, int nthreads) {
+    if (nthreads > 1)
+        count_names_parallel(c, stats, buf, len, nthreads);
+    else
+        count_names(c, stats, buf, buf + len);
+}
+
+// Block size for counting names from stdin or other unmappable input
+#define COUNT_BLOCK (64 << 20)
+
+// Counts all names read from input (stdin if NULL) into c, adding to stats
+// if it is not NULL. Files are mapped and counted whole; anything else is
+// read and counted a block at a time, so input of any size only needs one
+// block of memory.
+void count_input(struct ltrcounts *c, const char *input, int nthreads, struct build_stats *stats) {
+    struct build_stats unused = {0};
+    size_t len;
+    if (!stats)
+        stats = &unused;
+
+    const char *map = map_input(input, &len);
+    if (map) {
+        count_block(c, stats, map, len, nthreads);
+        unmap_input(map, len);
+        fflush(stderr);
+        return;
     }
-    for (int i = 0; i < ltr->header.num_letters; i++) {
-        for (int j = 0; j < ltr->header.num_letters; j++) {
-            float s = 0.0, m = 0.0, e = 0.0;
-            int startcount = 0, midcount = 0, endcount = 0;
-            for (int k = 0; k < ltr->header.num_letters; k++) {
-                startcount += (int)ltr->data.triples[i][j].start[k];
-                endcount += (int)ltr->data.triples[i][j].end[k];
-                midcount += (int)ltr->data.triples[i][j].middle[k];
-            }
-            for (int k = 0; k < ltr->header.num_letters; k++) {
-                if (ltr->data.triples[i][j].start[k] > 0.0) {
-                    ltr->data.triples[i][j].start[k] /= (float)startcount;
-                    s = ltr->data.triples[i][j].start[k] += s;
-                }
-                if (ltr->data.triples[i][j].end[k] > 0.0) {
-                    ltr->data.triples[i][j].end[k] /= (float)endcount;
-                    e = ltr->data.triples[i][j].end[k] += e;
-                }
-                if (ltr->data.triples[i][j].middle[k] > 0.0) {
-                    ltr->data.triples[i][j].middle[k] /= (float)midcount;
-                    m = ltr->data.triples[i][j].middle[k] += m;
-                }
-            }
+
+    FILE *f = input ? fopen(input, "rb") : stdin;
+    if (!f)
+        die("Unable to open file %s", input);
+    char *buf = malloc(COUNT_BLOCK);
+    if (!buf)
+        die("Out of memory");
+    size_t n;
+    len = 0;
+    do {
+        len += (n = fread(buf + len, 1, COUNT_BLOCK - len, f));
+        size_t cut = len;
+        if (n) {
+            // Keep the last word for the next block. count_names() splits
+            // words every 255 characters from their start, so whole pieces
+            // of a long word can be counted now.
+            size_t word = len;
+            while (word > 0 && !isspace((uint8_t)buf[word - 1]))
+                word--;
+            cut = word + (len - word) / 255 * 255;
         }
-    }
+        count_block(c, stats, buf, cut, nthreads);
+        memmove(buf, buf + cut, len - cut);
+        len -= cut;
+    } while (n);
+    if (ferror(f))
+        die("Error reading %s", input ? input : "stdin");
+    if (f != stdin)
+        fclose(f);
+    free(buf);
+    fflush(stderr);
+}
 
+void write_ltr(const char *filename, const struct ltrfile *ltr) {
     FILE *f = fopen(filename, "wb");
     if (!f) die("Unable to create file %s", filename);
     fwrite(&ltr->header, 9, 1, f);
@@ -331,6 +727,70 @@ void build_ltr(const char *filename, struct ltrfile *ltr) {
     fclose(f);
 }
 
+void build_ltr(const char *filename, const char *input, int nthreads, struct ltrfile *ltr,
+               struct build_stats *stats) {
+    struct ltrcounts *counts = calloc(1, sizeof(*counts));
+    if (!counts)
+        die("Out of memory");
+    count_input(counts, input, nthreads, stats);
+    ltr_from_counts(ltr, counts);
+    free(counts);
+    write_ltr(filename, ltr);
+}
+
+// Counts files hold the raw ltrcounts next to an ltr file, so new names can
+// be added without re-reading the original corpus. Same layout as ltr files:
+// a 9 byte header, then the tables in host byte order.
+#define COUNTS_MAGIC "LTR CNT1"
+
+// Returns the counts file kept alongside an ltr file: foo.ltr -> foo.cnt
+char *counts_filename(const char *ltrfile) {
+    size_t len = strlen(ltrfile);
+    char *name = malloc(len + 5);
+    if (!name)
+        die("Out of memory");
+    strcpy(name, ltrfile);
+    if (len > 4 && !strcmp(name + len - 4, ".ltr"))
+        name[len - 4] = '\0';
+    strcat(name, ".cnt");
+    return name;
+}
+
+// Reads the counts in filename and adds them to c
+void load_counts(const char *filename, struct ltrcounts *c) {
+    struct ltrcounts *in = malloc(sizeof(*in));
+    struct ltr_header header;
+    FILE *f = fopen(filename, "rb");
+    if (!in)
+        die("Out of memory");
+    if (!f)
+        die("Unable to open counts file %s", filename);
+
+    if (fread(&header, 9, 1, f) != 1 || strncmp(header.magic, COUNTS_MAGIC, 8))
+        die("File %s has no valid counts header", filename);
+    if (header.num_letters != NUM_LETTERS)
+        die("File built for %d letters, tool only supports %d.", header.num_letters, NUM_LETTERS);
+    if (fread(in, sizeof(*in), 1, f) != 1)
+        die("Unable to read the counts from %s. Truncated file?", filename);
+    fclose(f);
+
+    add_counts(c, in);
+    free(in);
+}
+
+void write_counts(const char *filename, const struct ltrcounts *c) {
+    struct ltr_header header;
+    memcpy(header.magic, COUNTS_MAGIC, 8);
+    header.num_letters = NUM_LETTERS;
+
+    FILE *f = fopen(filename, "wb");
+    if (!f) die("Unable to create file %s", filename);
+    fwrite(&header, 9, 1, f);
+    fwrite(c, sizeof(*c), 1, f);
+    if (fclose(f))
+        die("Error writing %s", filename);
+}
+
 void print_ltr(struct ltrfile *ltr) {
     printf("Num letters: %d\n", ltr->header.num_letters);
     printf("Sequence | CDF(start)  P(start) | CDF(middle)  P(middle) | CDF(end)  P(end)\n");
@@ -381,48 +841,404 @@ void print_ltr(struct ltrfile *ltr) {
     }
 }
 
-const char *random_name(struct ltrfile *ltr) {
-    static char namebuf[256];
+// Gets the probability of each letter when scanning cdf for the first entry
+// greater than a uniform random number, and of falling off the end of it in
+// p[NUM_LETTERS]. Entries of 0.0 are letters that never occur, so a letter's
+// probability is the amount by which its CDF value exceeds all previous ones.
+static void cdf_probs(const float *cdf, double *p) {
+    double max = 0.0;
+    for (int i = 0; i < NUM_LETTERS; i++) {
+        p[i] = cdf[i] > max ? cdf[i] - max : 0.0;
+        if (cdf[i] > max)
+            max = cdf[i];
+    }
+    p[NUM_LETTERS] = max < 1.0 ? 1.0 - max : 0.0;
+}
+
+// Builds the alias table equivalent to scanning cdf
+static void build_alias(struct alias *a, const float *cdf) {
+    double p[ALIAS_OUTCOMES], sum = 0.0;
+    cdf_probs(cdf, p);
+    for (int i = 0; i < ALIAS_OUTCOMES; i++)
+        sum += p[i];
+
+    // Vose's method: split outcomes into those below and above the average
+    // and let each small one borrow the rest of its column from a large one.
+    int small[ALIAS_OUTCOMES], large[ALIAS_OUTCOMES], ns = 0, nl = 0;
+    for (int i = 0; i < ALIAS_OUTCOMES; i++) {
+        p[i] = p[i] * ALIAS_OUTCOMES / sum;
+        if (p[i] < 1.0) small[ns++] = i;
+        else            large[nl++] = i;
+    }
+    while (ns && nl) {
+        int s = small[--ns], l = large[nl-1];
+        a->prob[s]  = p[s];
+        a->alias[s] = l;
+        p[l] -= 1.0 - p[s];
+        if (p[l] < 1.0) {
+            nl--;
+            small[ns++] = l;
+        }
+    }
+    while (nl) { int l = large[--nl]; a->prob[l] = 1.0; a->alias[l] = l; }
+    while (ns) { int s = small[--ns]; a->prob[s] = 1.0; a->alias[s] = s; }
+}
+
+static void build_alias_cdf(struct alias_cdf *a, const struct cdf *cdf) {
+    build_alias(&a->start,  cdf->start);
+    build_alias(&a->middle, cdf->middle);
+    build_alias(&a->end,    cdf->end);
+}
+
+// Finds the contexts (last two letters) from which a name can still end:
+// those with an end letter, or a middle letter leading to another such
+// context, and sets live[a][b] for those. Returns the number of contexts
+// that middle or start letters lead to, but which can't end.
+static int find_live_contexts(const struct ltrdata *d, uint8_t live[][NUM_LETTERS]) {
+    double (*middle)[NUM_LETTERS][ALIAS_OUTCOMES] = malloc(NUM_LETTERS * sizeof(*middle));
+    uint8_t entered[NUM_LETTERS][NUM_LETTERS] = {{0}};
+    double p[ALIAS_OUTCOMES];
+    int changed = 1, dead = 0;
+    if (!middle)
+        die("Out of memory");
+
+    for (int a = 0; a < NUM_LETTERS; a++) {
+        for (int b = 0; b < NUM_LETTERS; b++) {
+            cdf_probs(d->triples[a][b].end, p);
+            live[a][b] = p[NUM_LETTERS] < 1.0;
+            cdf_probs(d->triples[a][b].middle, middle[a][b]);
+        }
+    }
+    while (changed) {
+        changed = 0;
+        for (int a = 0; a < NUM_LETTERS; a++)
+            for (int b = 0; b < NUM_LETTERS; b++)
+                for (int c = 0; c < NUM_LETTERS && !live[a][b]; c++)
+                    if (middle[a][b][c] > 0.0 && live[b][c])
+                        live[a][b] = changed = 1;
+    }
+
+    for (int a = 0; a < NUM_LETTERS; a++) {
+        for (int b = 0; b < NUM_LETTERS; b++) {
+            cdf_probs(d->triples[a][b].start, p);
+            for (int c = 0; c < NUM_LETTERS; c++)
+                if (p[c] > 0.0 || middle[a][b][c] > 0.0)
+                    entered[b][c] = 1;
+        }
+    }
+    for (int a = 0; a < NUM_LETTERS; a++)
+        for (int b = 0; b < NUM_LETTERS; b++)
+            dead += entered[a][b] && !live[a][b];
+    free(middle);
+    return dead;
+}
+
+// Builds the alias tables for random_name_fast(), and finds the contexts
+// it can skip walking into (see there).
+void build_sampler(struct ltrfile *ltr) {
+    struct ltr_sampler *s = malloc(sizeof(*s));
+    if (!s)
+        die("Out of memory");
+
+    s->dead = find_live_contexts(&ltr->data, s->live);
+    build_alias_cdf(&s->singles, &ltr->data.singles);
+    for (int i = 0; i < NUM_LETTERS; i++) {
+        build_alias_cdf(&s->doubles[i], &ltr->data.doubles[i]);
+        for (int j = 0; j < NUM_LETTERS; j++)
+            build_alias_cdf(&s->triples[i][j], &ltr->data.triples[i][j]);
+    }
+    ltr->sampler = s;
+}
+
+static void compact_cdf(struct ltr_compact *c, uint8_t *letters, float *values,
+                        struct sparse_cdf *s, const struct cdf *cdf) {
+    const float *parts[3] = { cdf->start, cdf->middle, cdf->end };
+    s->offset = c->size;
+    for (int part = 0; part < 3; part++) {
+        s->count[part] = 0;
+        for (int i = 0; i < NUM_LETTERS; i++) {
+            if (parts[part][i] == 0.0)
+                continue;
+            letters[c->size] = i;
+            values[c->size++] = parts[part][i];
+            s->count[part]++;
+        }
+    }
+}
+
+// Builds ltr->compact from the tables, which should be fixed first
+void build_compact(struct ltrfile *ltr) {
+    struct ltr_compact *c = calloc(1, sizeof(*c));
+    size_t size = 0;
+    const float *p = (const float *)&ltr->data;
+    for (size_t i = 0; i < sizeof(ltr->data) / sizeof(float); i++)
+        size += p[i] != 0.0;
+    uint8_t *letters = malloc(size + 1);
+    float *values = malloc((size + 1) * sizeof(float));
+    if (!c || !letters || !values)
+        die("Out of memory");
+
+    compact_cdf(c, letters, values, &c->contexts[CTX_SINGLES], &ltr->data.singles);
+    for (int i = 0; i < NUM_LETTERS; i++) {
+        compact_cdf(c, letters, values, &c->contexts[CTX_DOUBLES(i)], &ltr->data.doubles[i]);
+        for (int j = 0; j < NUM_LETTERS; j++)
+            compact_cdf(c, letters, values, &c->contexts[CTX_TRIPLES(i, j)], &ltr->data.triples[i][j]);
+    }
+    c->letters = letters;
+    c->values  = values;
+    ltr->compact = c;
+}
+
+static void expand_cdf(const struct ltr_compact *c, const struct sparse_cdf *s, struct cdf *cdf) {
+    float *parts[3] = { cdf->start, cdf->middle, cdf->end };
+    uint32_t k = s->offset;
+    memset(cdf, 0, sizeof(*cdf));
+    for (int part = 0; part < 3; part++)
+        for (int n = 0; n < s->count[part]; n++, k++)
+            parts[part][c->letters[k]] = c->values[k];
+}
+
+// Fills ltr->data back in from ltr->compact, for tables that only come with
+// the compact copy (see ltr_registry_load_embedded()). The compact copy
+// only leaves out zeros, so this gives the exact tables it was built from.
+void ltr_from_compact(struct ltrfile *ltr) {
+    const struct ltr_compact *c = ltr->compact;
+    expand_cdf(c, &c->contexts[CTX_SINGLES], &ltr->data.singles);
+    for (int i = 0; i < NUM_LETTERS; i++) {
+        expand_cdf(c, &c->contexts[CTX_DOUBLES(i)], &ltr->data.doubles[i]);
+        for (int j = 0; j < NUM_LETTERS; j++)
+            expand_cdf(c, &c->contexts[CTX_TRIPLES(i, j)], &ltr->data.triples[i][j]);
+    }
+}
+
+static void pad_cdf(struct padded_cdf *p, const struct cdf *cdf) {
+    const float *parts[3] = { cdf->start, cdf->middle, cdf->end };
+    for (int part = 0; part < 3; part++)
+        for (int i = 0; i < CDF_PAD; i++)
+            p->part[part][i] = i < NUM_LETTERS ? parts[part][i] : -1.0;
+}
+
+// Builds ltr->padded from the tables, which should be fixed first
+void build_padded(struct ltrfile *ltr) {
+    struct ltr_padded *p;
+#ifdef _WIN32
+    if (!(p = _aligned_malloc(sizeof(*p), CDF_PAD * sizeof(float))))
+#else
+    if (posix_memalign((void **)&p, CDF_PAD * sizeof(float), sizeof(*p)))
+#endif
+        die("Out of memory");
+
+    pad_cdf(&p->contexts[CTX_SINGLES], &ltr->data.singles);
+    for (int i = 0; i < NUM_LETTERS; i++) {
+        pad_cdf(&p->contexts[CTX_DOUBLES(i)], &ltr->data.doubles[i]);
+        for (int j = 0; j < NUM_LETTERS; j++)
+            pad_cdf(&p->contexts[CTX_TRIPLES(i, j)], &ltr->data.triples[i][j]);
+    }
+    ltr->padded = p;
+}
+
+// Frees the tables built by build_sampler(), build_compact() and build_padded().
+// Not for tables from ltr_registry_load_embedded(), whose compact copy is static.
+void free_ltr(struct ltrfile *ltr) {
+    if (ltr->compact) {
+        free((void *)ltr->compact->letters);
+        free((void *)ltr->compact->values);
+        free((void *)ltr->compact);
+    }
+    free(ltr->sampler);
+#ifdef _WIN32
+    _aligned_free(ltr->padded);
+#else
+    free(ltr->padded);
+#endif
+    ltr->compact = NULL;
+    ltr->sampler = NULL;
+    ltr->padded  = NULL;
+}
+
+enum { CDF_START, CDF_MIDDLE, CDF_END };
+
+// Returns the letter index of the first entry in part of s above prob, or
+// NUM_LETTERS if there is none
+static inline int sparse_find(const struct ltr_compact *c, const struct sparse_cdf *s, int part, float prob) {
+    uint32_t k = s->offset, end;
+    for (int j = 0; j < part; j++)
+        k += s->count[j];
+    for (end = k + s->count[part]; k < end; k++)
+        if (prob < c->values[k])
+            return c->letters[k];
+    return NUM_LETTERS;
+}
+
+// Returns the index of the first entry of a padded CDF above prob, or
+// NUM_LETTERS if there is none: a compare of all entries, then the lowest
+// set bit of the resulting mask. Uses AVX2, SSE2 or NEON when compiled for
+// them (e.g. with -march=native), and a plain loop otherwise.
+#if NUM_LETTERS > CDF_PAD
+#error "NUM_LETTERS must fit in CDF_PAD"
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+static inline int cdf_find(const float *cdf, float prob) {
+    uint32_t mask = 0;
+#if defined(__AVX2__)
+    __m256 p = _mm256_set1_ps(prob);
+    for (int i = 0; i < CDF_PAD; i += 8)
+        mask |= (uint32_t)_mm256_movemask_ps(_mm256_cmp_ps(p, _mm256_load_ps(cdf + i), _CMP_LT_OQ)) << i;
+#elif defined(__SSE2__)
+    __m128 p = _mm_set1_ps(prob);
+    for (int i = 0; i < CDF_PAD; i += 4)
+        mask |= (uint32_t)_mm_movemask_ps(_mm_cmplt_ps(p, _mm_load_ps(cdf + i))) << i;
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    static const uint32_t bits[4] = { 1, 2, 4, 8 };
+    float32x4_t p = vdupq_n_f32(prob);
+    uint32x4_t b = vld1q_u32(bits);
+    for (int i = 0; i < CDF_PAD; i += 4)
+        mask |= vaddvq_u32(vandq_u32(vcltq_f32(p, vld1q_f32(cdf + i)), b)) << i;
+#else
+    for (int i = 0; i < NUM_LETTERS; i++)
+        if (prob < cdf[i])
+            return i;
+#endif
+    return mask ? __builtin_ctz(mask) : NUM_LETTERS;
+}
+
+// Returns a letter index, or NUM_LETTERS if the draw fell off the table
+static int alias_draw(const struct alias *a, struct rng_state *rng) {
+    float u = rng_float(rng) * ALIAS_OUTCOMES;
+    int k = (int)u;
+    if (k >= ALIAS_OUTCOMES)
+        k = ALIAS_OUTCOMES - 1;
+    return (u - k < a->prob[k]) ? k : a->alias[k];
+}
+
+// Shortest buffer a name fits in: three start letters, an end letter, NUL
+#define MIN_NAME_CAP 5
+// Buffer size used for each name by ltr_generate_batch()
+#define MAX_NAME_CAP 256
+
+// Same as random_name_exact(), with every letter drawn in constant time
+// from the alias tables. The end and middle tables get independent draws
+// rather than sharing one, so the output differs from the game's for a
+// given seed. Walks into contexts from which no name can end are cut short
+// where the game's outcome is already known: the game backs out of such a
+// middle letter again, so it is undone at once and counted as a backoff,
+// and a name whose first three letters lead nowhere can only be restarted.
+static size_t random_name_fast(const struct ltrfile *ltr, struct rng_state *rng, char *out, size_t cap) {
+    const struct ltr_sampler *s = ltr->sampler;
+    int attempts;
+    char *p;
+    int i;
+
+    rng->stats.names++;
+    goto again;
+restart:
+    rng->stats.restarts++;
+again:
+    attempts = 0;
+    p = out;
+    rng->stats.draws += 3;
+
+    if ((i = alias_draw(&s->singles.start, rng)) == NUM_LETTERS)
+        goto restart;
+    *p++ = letters[i];
+
+    if ((i = alias_draw(&s->doubles[idx(p[-1])].start, rng)) == NUM_LETTERS)
+        goto restart;
+    *p++ = letters[i];
+
+    if ((i = alias_draw(&s->triples[idx(p[-2])][idx(p[-1])].start, rng)) == NUM_LETTERS)
+        goto restart;
+    *p++ = letters[i];
+    if (!s->live[idx(p[-2])][idx(p[-1])])
+        goto restart;
+
+    while (1) {
+        const struct alias_cdf *t = &s->triples[idx(p[-2])][idx(p[-1])];
+        rng->stats.draws++;
+        if (rng_below(rng, 12) <= (p - out)) {
+            rng->stats.draws++;
+            if ((i = alias_draw(&t->end, rng)) != NUM_LETTERS) {
+                *p++ = letters[i]; *p = '\0';
+                out[0] = toupper(out[0]);
+                return p - out;
+            }
+        }
+
+        if ((i = alias_draw(&t->middle, rng)) != NUM_LETTERS && !s->live[idx(p[-1])][i]) {
+            rng->stats.backoffs++;
+            if (++attempts > 100) {
+                rng->stats.bailouts++;
+                goto restart;
+            }
+        } else if (i != NUM_LETTERS) {
+            *p++ = letters[i];
+            if ((size_t)(p - out) + 2 > cap)
+                goto restart;
+        } else {
+            rng->stats.backoffs++;
+            if (--p - out < 3)
+                goto restart;
+            if (++attempts > 100) {
+                rng->stats.bailouts++;
+                goto restart;
+            }
+        }
+    }
+}
+
+static size_t random_name_exact(const struct ltrfile *ltr, struct rng_state *rng, char *out, size_t cap) {
     int attempts;
     char *p;
     float prob;
     int i;
 
+    rng->stats.names++;
+    goto again;
+restart:
+    rng->stats.restarts++;
 again:
     attempts = 0;
-    p = &namebuf[0];
+    p = out;
+    rng->stats.draws += 3;
 
-    for (i = 0, prob = nrand(); i < ltr->header.num_letters; i++)
+    for (i = 0, prob = rng_float(rng); i < ltr->header.num_letters; i++)
         if (prob < ltr->data.singles.start[i])
             break;
     // This can happen if the training set was too small
     if (i == ltr->header.num_letters)
-        goto again;
+        goto restart;
     *p++ = letters[i];
 
-    for (i = 0, prob = nrand(); i < ltr->header.num_letters; i++)
+    for (i = 0, prob = rng_float(rng); i < ltr->header.num_letters; i++)
         if (prob < ltr->data.doubles[idx(p[-1])].start[i])
             break;
     if (i == ltr->header.num_letters)
-        goto again;
+        goto restart;
     *p++ = letters[i];
 
-    for (i = 0, prob = nrand(); i < ltr->header.num_letters; i++)
+    for (i = 0, prob = rng_float(rng); i < ltr->header.num_letters; i++)
         if (prob < ltr->data.triples[idx(p[-2])][idx(p[-1])].start[i])
             break;
     if (i == ltr->header.num_letters)
-        goto again;
+        goto restart;
     *p++ = letters[i];
 
     while (1) {
-        prob = nrand();
+        prob = rng_float(rng);
+        rng->stats.draws++;
         // Arbitrary end threshold form the core game
-        if ((rand() % 12) <= (p - namebuf)) {
+        if (rng_below(rng, 12) <= (p - out)) {
             for (i = 0; i < ltr->header.num_letters; i++) {
                 if (prob < ltr->data.triples[idx(p[-2])][idx(p[-1])].end[i]) {
                     *p++ = letters[i]; *p = '\0';
-                    namebuf[0] = toupper(namebuf[0]);
-                    return namebuf;
+                    out[0] = toupper(out[0]);
+                    return p - out;
                 }
             }
         }
@@ -435,20 +1251,716 @@ again:
         }
 
         if (i == ltr->header.num_letters) {
-            if (--p - namebuf < 3 || ++attempts > 100)
-                goto again;
+            rng->stats.backoffs++;
+            if (--p - out < 3)
+                goto restart;
+            if (++attempts > 100) {
+                rng->stats.bailouts++;
+                goto restart;
+            }
+        } else if ((size_t)(p - out) + 2 > cap) {
+            goto restart;
+        }
+    }
+}
+
+// First letter above prob in the CDF part of a context, in the compact or
+// the padded tables
+enum exact_tables { TABLES_COMPACT, TABLES_PADDED };
+static inline int table_find(const struct ltrfile *ltr, enum exact_tables kind, int ctx, int part, float prob) {
+    if (kind == TABLES_PADDED)
+        return cdf_find(ltr->padded->contexts[ctx].part[part], prob);
+    return sparse_find(ltr->compact, &ltr->compact->contexts[ctx], part, prob);
+}
+
+// Same as random_name_exact(), on the compact or padded tables. Inlined into
+// a function for each kind, so that the choice costs nothing per letter.
+static inline size_t random_name_tables(const struct ltrfile *ltr, enum exact_tables kind,
+                                        struct rng_state *rng, char *out, size_t cap) {
+    int attempts;
+    char *p;
+    float prob;
+    int i;
+
+    rng->stats.names++;
+    goto again;
+restart:
+    rng->stats.restarts++;
+again:
+    attempts = 0;
+    p = out;
+    rng->stats.draws += 3;
+
+    if ((i = table_find(ltr, kind, CTX_SINGLES, CDF_START, rng_float(rng))) == NUM_LETTERS)
+        goto restart;
+    *p++ = letters[i];
+
+    if ((i = table_find(ltr, kind, CTX_DOUBLES(idx(p[-1])), CDF_START, rng_float(rng))) == NUM_LETTERS)
+        goto restart;
+    *p++ = letters[i];
+
+    if ((i = table_find(ltr, kind, CTX_TRIPLES(idx(p[-2]), idx(p[-1])), CDF_START, rng_float(rng))) == NUM_LETTERS)
+        goto restart;
+    *p++ = letters[i];
+
+    while (1) {
+        int ctx = CTX_TRIPLES(idx(p[-2]), idx(p[-1]));
+        prob = rng_float(rng);
+        rng->stats.draws++;
+        if (rng_below(rng, 12) <= (p - out)) {
+            if ((i = table_find(ltr, kind, ctx, CDF_END, prob)) != NUM_LETTERS) {
+                *p++ = letters[i]; *p = '\0';
+                out[0] = toupper(out[0]);
+                return p - out;
+            }
+        }
+
+        if ((i = table_find(ltr, kind, ctx, CDF_MIDDLE, prob)) != NUM_LETTERS) {
+            *p++ = letters[i];
+            if ((size_t)(p - out) + 2 > cap)
+                goto restart;
+        } else {
+            rng->stats.backoffs++;
+            if (--p - out < 3)
+                goto restart;
+            if (++attempts > 100) {
+                rng->stats.bailouts++;
+                goto restart;
+            }
+        }
+    }
+}
+
+static size_t random_name_compact(const struct ltrfile *ltr, struct rng_state *rng, char *out, size_t cap) {
+    return random_name_tables(ltr, TABLES_COMPACT, rng, out, cap);
+}
+
+static size_t random_name_padded(const struct ltrfile *ltr, struct rng_state *rng, char *out, size_t cap) {
+    return random_name_tables(ltr, TABLES_PADDED, rng, out, cap);
+}
+
+// Generates one NUL terminated name into out, which must hold at least
+// MIN_NAME_CAP bytes. Names that would not fit in cap are discarded and
+// regenerated. Uses the fast sampler if build_sampler() was called on ltr,
+// the game's exact algorithm otherwise, on the padded or compact tables if
+// build_padded() or build_compact() was called.
+// Reentrant: all state is in ltr (read only) and rng. Returns the name
+// length, or 0 if cap is too small.
+size_t ltr_generate(const struct ltrfile *ltr, struct rng_state *rng, char *out, size_t cap) {
+    if (cap < MIN_NAME_CAP)
+        return 0;
+    if (ltr->sampler)
+        return random_name_fast(ltr, rng, out, cap);
+    if (ltr->padded)
+        return random_name_padded(ltr, rng, out, cap);
+    if (ltr->compact)
+        return random_name_compact(ltr, rng, out, cap);
+    return random_name_exact(ltr, rng, out, cap);
+}
+
+// Fills out with up to n newline terminated names, stopping early when the
+// next one might not fit. Returns the number of names generated, and the
+// number of bytes used in *used. The buffer is not NUL terminated.
+size_t ltr_generate_batch(const struct ltrfile *ltr, struct rng_state *rng, size_t n, char *out, size_t cap, size_t *used) {
+    size_t count = 0, pos = 0;
+    while (count < n && cap - pos >= MAX_NAME_CAP) {
+        pos += ltr_generate(ltr, rng, out + pos, MAX_NAME_CAP);
+        out[pos++] = '\n';
+        count++;
+    }
+    *used = pos;
+    return count;
+}
+
+// All the ltr files in a directory, loaded once and looked up by name, which
+// is the file name without .ltr ("elff" for elff.ltr).
+struct ltr_registry {
+    size_t count;
+    char **names;
+    struct ltrfile **tables;
+};
+
+static int registry_cmp(const void *a, const void *b) {
+    return strcasecmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Loads every .ltr file in dir into reg, fixing them unless nofix is set and
+// building their samplers if sampler is set.
+void ltr_registry_load(struct ltr_registry *reg, const char *dir, int nofix, int sampler) {
+    DIR *d = opendir(dir);
+    if (!d)
+        die("Unable to open directory %s", dir);
+
+    struct dirent *e;
+    size_t capacity = 0;
+    memset(reg, 0, sizeof(*reg));
+    while ((e = readdir(d))) {
+        size_t len = strlen(e->d_name);
+        if (len <= 4 || strcasecmp(e->d_name + len - 4, ".ltr"))
+            continue;
+        if (reg->count == capacity) {
+            capacity = capacity ? capacity * 2 : 32;
+            if (!(reg->names = realloc(reg->names, capacity * sizeof(char *))))
+                die("Out of memory");
+        }
+        if (!(reg->names[reg->count] = strdup(e->d_name)))
+            die("Out of memory");
+        reg->names[reg->count++][len - 4] = '\0';
+    }
+    closedir(d);
+    qsort(reg->names, reg->count, sizeof(char *), registry_cmp);
+
+    if (!(reg->tables = calloc(reg->count ? reg->count : 1, sizeof(struct ltrfile *))))
+        die("Out of memory");
+    for (size_t i = 0; i < reg->count; i++) {
+        char *path = malloc(strlen(dir) + strlen(reg->names[i]) + 6);
+        if (!path || !(reg->tables[i] = calloc(1, sizeof(struct ltrfile))))
+            die("Out of memory");
+        sprintf(path, "%s/%s.ltr", dir, reg->names[i]);
+        load_ltr(path, reg->tables[i]);
+        free(path);
+        if (!nofix)
+            fix_ltr(reg->tables[i]);
+        if (sampler)
+            build_sampler(reg->tables[i]);
+    }
+}
+
+// Finds a table by name, case insensitively. If gender is given it is
+// appended to name, so ("elf", "f") finds elff. Returns NULL if not found.
+const struct ltrfile *ltr_registry_find(const struct ltr_registry *reg, const char *name, const char *gender) {
+    char key[256];
+    snprintf(key, sizeof(key), "%s%s", name, gender ? gender : "");
+    char *k = key;
+    char **found = bsearch(&k, reg->names, reg->count, sizeof(char *), registry_cmp);
+    return found ? reg->tables[found - reg->names] : NULL;
+}
+
+#ifdef NWNLTR_EMBEDDED
+// Tables compiled into the program: NWNLTR_EMBEDDED names a file written by
+// --emit-c, which defines ltr_embedded[] sorted by name.
+struct ltr_embedded {
+    const char *name;
+    const struct ltr_compact *compact;
+};
+#include NWNLTR_EMBEDDED
+
+// Fills reg with the compiled in tables, with no file I/O. Only their compact
+// copy is set, which is all the game's exact algorithm needs; call
+// ltr_from_compact() on a table before using anything else on it.
+void ltr_registry_load_embedded(struct ltr_registry *reg) {
+    reg->count = sizeof(ltr_embedded) / sizeof(ltr_embedded[0]);
+    if (!(reg->names = malloc(reg->count * sizeof(char *))) ||
+        !(reg->tables = calloc(reg->count, sizeof(struct ltrfile *))))
+        die("Out of memory");
+    for (size_t i = 0; i < reg->count; i++) {
+        if (!(reg->tables[i] = calloc(1, sizeof(struct ltrfile))))
+            die("Out of memory");
+        reg->names[i] = (char *)ltr_embedded[i].name;
+        memcpy(reg->tables[i]->header.magic, "LTR V1.0", 8);
+        reg->tables[i]->header.num_letters = NUM_LETTERS;
+        reg->tables[i]->compact = ltr_embedded[i].compact;
+    }
+}
+#endif
+
+// Set of names for --unique and --exclude: open addressing over offsets
+// into an arena holding the lowercased, NUL terminated names back to back.
+struct nameset {
+    uint32_t *hashes;
+    uint32_t *offsets;   // offset + 1 into arena, 0 for an empty slot
+    uint32_t  size;      // always a power of two
+    uint32_t  used;
+    char     *arena;
+    size_t    arena_size;
+    size_t    arena_capacity;
+};
+
+static uint32_t name_hash(const char *name, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (uint8_t)tolower((uint8_t)name[i])) * 16777619u;
+    return h;
+}
+
+static int name_equal(const char *stored, const char *name, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (stored[i] != tolower((uint8_t)name[i]))
+            return 0;
+    }
+    return stored[len] == '\0';
+}
+
+static void nameset_insert_slot(struct nameset *set, uint32_t hash, uint32_t offset) {
+    uint32_t i = hash & (set->size - 1);
+    while (set->offsets[i])
+        i = (i + 1) & (set->size - 1);
+    set->hashes[i]  = hash;
+    set->offsets[i] = offset;
+}
+
+// Returns 1 if name is in the set
+int nameset_contains(const struct nameset *set, const char *name, size_t len) {
+    if (!set->size)
+        return 0;
+    uint32_t hash = name_hash(name, len);
+    for (uint32_t i = hash & (set->size - 1); set->offsets[i]; i = (i + 1) & (set->size - 1)) {
+        if (set->hashes[i] == hash && name_equal(&set->arena[set->offsets[i] - 1], name, len))
+            return 1;
+    }
+    return 0;
+}
+
+// Adds name to the set; returns 1 if it was not there already
+int nameset_add(struct nameset *set, const char *name, size_t len) {
+    if (nameset_contains(set, name, len))
+        return 0;
+
+    if ((set->used + 1) * 2 > set->size) {
+        uint32_t oldsize = set->size;
+        uint32_t *oldhashes = set->hashes, *oldoffsets = set->offsets;
+        set->size    = oldsize ? oldsize * 2 : 4096;
+        set->hashes  = malloc(set->size * sizeof(*set->hashes));
+        set->offsets = calloc(set->size, sizeof(*set->offsets));
+        if (!set->hashes || !set->offsets)
+            die("Out of memory");
+        for (uint32_t i = 0; i < oldsize; i++) {
+            if (oldoffsets[i])
+                nameset_insert_slot(set, oldhashes[i], oldoffsets[i]);
+        }
+        free(oldhashes);
+        free(oldoffsets);
+    }
+
+    if (set->arena_size + len + 1 > set->arena_capacity) {
+        set->arena_capacity = set->arena_capacity ? set->arena_capacity * 2 : 65536;
+        if (set->arena_capacity + len + 1 > UINT32_MAX || !(set->arena = realloc(set->arena, set->arena_capacity)))
+            die("Out of memory");
+    }
+    char *stored = &set->arena[set->arena_size];
+    for (size_t i = 0; i < len; i++)
+        stored[i] = tolower((uint8_t)name[i]);
+    stored[len] = '\0';
+
+    nameset_insert_slot(set, name_hash(name, len), set->arena_size + 1);
+    set->arena_size += len + 1;
+    set->used++;
+    return 1;
+}
+
+void nameset_load(struct nameset *set, const char *filename) {
+    FILE *f = fopen(filename, "r");
+    if (!f)
+        die("Unable to open file %s", filename);
+
+    char buf[1024];
+    while (fgets(buf, sizeof(buf), f)) {
+        size_t len = strcspn(buf, "\r\n");
+        while (len && isspace((uint8_t)buf[len-1]))
+            len--;
+        char *name = buf;
+        while (len && isspace((uint8_t)*name)) {
+            name++;
+            len--;
+        }
+        if (len)
+            nameset_add(set, name, len);
+    }
+    fclose(f);
+}
+
+#ifndef NWNLTR_NO_MAIN
+// Writes out newline separated names from buf, skipping those rejected by
+// --unique/--exclude, until *want names have been written. Without a filter
+// all of buf is written and *want is left to the caller.
+#define MAX_REJECTED_IN_A_ROW 1000000
+struct namefilter {
+    struct nameset set;
+    int    unique;
+    size_t rejected;     // consecutive rejected names
+};
+
+void write_names(struct namefilter *filter, char *buf, size_t len, size_t *want) {
+    if (!filter) {
+        fwrite(buf, 1, len, stdout);
+        return;
+    }
+
+    char *out = buf;
+    for (char *p = buf, *end = buf + len; p < end && *want; ) {
+        char *nl = memchr(p, '\n', end - p);
+        size_t n = nl - p;
+        int ok = filter->unique ? nameset_add(&filter->set, p, n) : !nameset_contains(&filter->set, p, n);
+        if (ok) {
+            memmove(out, p, n + 1);
+            out += n + 1;
+            (*want)--;
+            filter->rejected = 0;
+        } else if (++filter->rejected > MAX_REJECTED_IN_A_ROW) {
+            fwrite(buf, 1, out - buf, stdout);
+            fflush(stdout);
+            die("Unable to find more new names after %d attempts, %zu names short", MAX_REJECTED_IN_A_ROW, *want);
+        }
+        p = nl + 1;
+    }
+    fwrite(buf, 1, out - buf, stdout);
+}
+
+// Parallel generation for --jobs. Each thread generates its share of the
+// names from its own RNG stream, in rounds of up to one buffer each, and the
+// main thread writes the buffers out in thread order after every round.
+// When filtering, threads keep generating full buffers until enough names
+// have passed the filter.
+#define JOB_BUFFER_SIZE (1 << 20)
+struct genjob {
+    const struct ltrfile *ltr;
+    struct rng_state rng;
+    size_t remaining;
+    size_t used;
+    char  *buf;
+};
+
+static void *generate_worker(void *arg) {
+    struct genjob *job = arg;
+    job->remaining -= ltr_generate_batch(job->ltr, &job->rng, job->remaining, job->buf, JOB_BUFFER_SIZE, &job->used);
+    return NULL;
+}
+
+// Generates count names on nthreads threads, adding their counters to stats
+void generate_parallel(const struct ltrfile *ltr, const struct rng_state *rng, size_t count, int nthreads,
+                       struct namefilter *filter, struct ltr_stats *stats) {
+    struct genjob *jobs = calloc(nthreads, sizeof(*jobs));
+    pthread_t *threads = calloc(nthreads, sizeof(*threads));
+    if (!jobs || !threads)
+        die("Out of memory");
+
+    for (int t = 0; t < nthreads; t++) {
+        jobs[t].ltr       = ltr;
+        jobs[t].rng       = *rng;
+        jobs[t].remaining = filter ? SIZE_MAX : count / nthreads + ((size_t)t < count % nthreads);
+        if (!(jobs[t].buf = malloc(JOB_BUFFER_SIZE)))
+            die("Out of memory");
+        rng_stream(&jobs[t].rng, t);
+    }
+
+    while (count) {
+        for (int t = 0; t < nthreads; t++) {
+            if (pthread_create(&threads[t], NULL, generate_worker, &jobs[t]))
+                die("Unable to create thread");
+        }
+        for (int t = 0; t < nthreads; t++)
+            pthread_join(threads[t], NULL);
+        for (int t = 0; t < nthreads && count; t++)
+            write_names(filter, jobs[t].buf, jobs[t].used, &count);
+        if (!filter) {
+            count = 0;
+            for (int t = 0; t < nthreads; t++)
+                count += jobs[t].remaining;
+        }
+    }
+
+    for (int t = 0; t < nthreads; t++) {
+        stats->names    += jobs[t].rng.stats.names;
+        stats->draws    += jobs[t].rng.stats.draws;
+        stats->restarts += jobs[t].rng.stats.restarts;
+        stats->bailouts += jobs[t].rng.stats.bailouts;
+        stats->backoffs += jobs[t].rng.stats.backoffs;
+        free(jobs[t].buf);
+    }
+    free(jobs);
+    free(threads);
+}
+
+// --bench: times loading, fixing, generating and building tables
+#define BENCH_NAMES 100000
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int u64cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// First letters and lengths of the generated names, to check that the
+// faster generators give the same distribution as the exact one
+struct name_dist {
+    uint64_t first[NUM_LETTERS];
+    uint64_t length[MAX_NAME_CAP];
+};
+
+// Largest difference in the share of any first letter, and the total
+// variation distance between the name lengths
+static void dist_compare(const struct name_dist *a, const struct name_dist *b, size_t count,
+                         double *first, double *length) {
+    *first = *length = 0.0;
+    for (int i = 0; i < NUM_LETTERS; i++) {
+        double d = (a->first[i] > b->first[i] ? a->first[i] - b->first[i] : b->first[i] - a->first[i]) / (double)count;
+        if (d > *first)
+            *first = d;
+    }
+    for (int i = 0; i < MAX_NAME_CAP; i++)
+        *length += (a->length[i] > b->length[i] ? a->length[i] - b->length[i] : b->length[i] - a->length[i]) / (double)count / 2;
+}
+
+// Generates count names one at a time, timing each of them, and compares
+// their distribution to ref if given
+static void bench_generate(const char *name, const char *mode, const struct ltrfile *ltr,
+                           struct rng_state *rng, size_t count, uint64_t *latency,
+                           const struct name_dist *ref, struct name_dist *dist) {
+    struct ltr_stats before = rng->stats;
+    char buf[MAX_NAME_CAP];
+    memset(dist, 0, sizeof(*dist));
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < count; i++) {
+        uint64_t t = now_ns();
+        size_t len = ltr_generate(ltr, rng, buf, sizeof(buf));
+        latency[i] = now_ns() - t;
+        dist->first[idx(tolower((uint8_t)buf[0]))]++;
+        dist->length[len]++;
+    }
+    double secs = (now_ns() - start) / 1e9;
+
+    qsort(latency, count, sizeof(*latency), u64cmp);
+    printf("%-12s %-6s %12.0f %8llu %8llu %9llu %13.4f %13.4f", name, mode, count / secs,
+           (unsigned long long)latency[count / 2], (unsigned long long)latency[count * 99 / 100],
+           (unsigned long long)latency[count - 1],
+           (double)(rng->stats.restarts - before.restarts) / count,
+           (double)(rng->stats.backoffs - before.backoffs) / count);
+    if (ref) {
+        double first, length;
+        dist_compare(ref, dist, count, &first, &length);
+        printf(" %10.4f %10.4f\n", first, length);
+    } else {
+        printf(" %10s %10s\n", "-", "-");
+    }
+}
+
+// Counts the count names in corpus and builds a table from them
+static void bench_build(const char *name, double load_ms, const char *corpus, size_t len, size_t count) {
+    static struct ltrfile ltr;
+    struct ltrcounts *counts = calloc(1, sizeof(*counts));
+    if (!counts)
+        die("Out of memory");
+
+    uint64_t start = now_ns();
+    struct build_stats stats = {0};
+    count_names(counts, &stats, corpus, corpus + len);
+    ltr_from_counts(&ltr, counts);
+    double secs = (now_ns() - start) / 1e9;
+    free(counts);
+
+    if (load_ms < 0)
+        printf("%-12s %8s %14.0f %10.1f\n", name, "-", count / secs, len / secs / 1e6);
+    else
+        printf("%-12s %8.3f %14.0f %10.1f\n", name, load_ms, count / secs, len / secs / 1e6);
+}
+
+// Benchmarks ltrfile, or every .ltr file in it if it is a directory, and
+// a corpus of random letter strings
+void bench(const char *ltrfile, struct rng_state *rng, size_t count) {
+    static struct ltrfile ltr;
+    static struct name_dist exact, dist;
+    struct ltr_registry registry = {0};
+    const char *single = ltrfile;
+    char basename[256];
+    DIR *d = opendir(ltrfile);
+    if (d) {
+        closedir(d);
+        ltr_registry_load(&registry, ltrfile, 1, 0);
+        single = NULL;
+    } else {
+        // Name the table like the registry does, foo for dir/foo.ltr
+        snprintf(basename, sizeof(basename), "%s", strrchr(ltrfile, '/') ? strrchr(ltrfile, '/') + 1 : ltrfile);
+        if (strlen(basename) > 4 && !strcasecmp(basename + strlen(basename) - 4, ".ltr"))
+            basename[strlen(basename) - 4] = '\0';
+    }
+    size_t ntables = single ? 1 : registry.count;
+    double *load_ms = calloc(ntables, sizeof(double));
+    uint64_t *latency = malloc(count * sizeof(uint64_t));
+    char **corpus = calloc(ntables, sizeof(char *));
+    size_t *corpus_len = calloc(ntables, sizeof(size_t));
+    if (!load_ms || !latency || !corpus || !corpus_len)
+        die("Out of memory");
+
+    printf("Generating %zu names per table with the %s RNG\n", count, rng_names[rng->kind]);
+    printf("first/length: largest difference in any first letter's share against exact, and\n"
+           "total variation of name lengths. simd runs the exact algorithm, so its values\n"
+           "are what sampling noise alone gives\n");
+    printf("%-12s %-6s %12s %8s %8s %9s %13s %13s %10s %10s\n", "table", "mode", "names/s",
+           "p50 ns", "p99 ns", "max ns", "restarts/name", "backoffs/name", "first", "length");
+    for (size_t t = 0; t < ntables; t++) {
+        char path[4096];
+        const char *name = single ? basename : registry.names[t];
+        if (single)
+            snprintf(path, sizeof(path), "%s", single);
+        else
+            snprintf(path, sizeof(path), "%s/%s.ltr", ltrfile, name);
+
+        uint64_t start = now_ns();
+        load_ltr(path, &ltr);
+        fix_ltr(&ltr);
+        load_ms[t] = (now_ns() - start) / 1e6;
+
+        build_compact(&ltr);
+        bench_generate(name, "exact", &ltr, rng, count, latency, NULL, &exact);
+        build_padded(&ltr);
+        bench_generate(name, "simd", &ltr, rng, count, latency, &exact, &dist);
+        build_sampler(&ltr);
+        bench_generate(name, "fast", &ltr, rng, count, latency, &exact, &dist);
+
+        // Names from this table are the corpus for the build benchmark
+        size_t used, n = 0, size = count * 16 + MAX_NAME_CAP;
+        if (!(corpus[t] = malloc(size)))
+            die("Out of memory");
+        while (n < count) {
+            if (size - corpus_len[t] < MAX_NAME_CAP && !(corpus[t] = realloc(corpus[t], size *= 2)))
+                die("Out of memory");
+            n += ltr_generate_batch(&ltr, rng, count - n, corpus[t] + corpus_len[t], size - corpus_len[t], &used);
+            corpus_len[t] += used;
         }
+        free_ltr(&ltr);
+    }
+
+    printf("\nBuilding tables from %zu names each (load includes fix_ltr())\n", count);
+    printf("%-12s %8s %14s %10s\n", "table", "load ms", "build names/s", "build MB/s");
+    for (size_t t = 0; t < ntables; t++) {
+        bench_build(single ? basename : registry.names[t], load_ms[t], corpus[t], corpus_len[t], count);
+        free(corpus[t]);
+    }
+
+    // Random strings of 3 to 12 letters, to cover every context
+    char *synthetic = malloc(count * 13), *p = synthetic;
+    if (!synthetic)
+        die("Out of memory");
+    for (size_t i = 0; i < count; i++) {
+        for (int len = 3 + rng_below(rng, 10); len; len--)
+            *p++ = letters[rng_below(rng, NUM_LETTERS)];
+        *p++ = '\n';
     }
+    bench_build("synthetic", -1, synthetic, p - synthetic, count);
+
+    free(synthetic);
+    free(corpus);
+    free(corpus_len);
+    free(latency);
+    free(load_ms);
+}
+
+// --emit-c: prints the compact copy of every table in dir as C source, to be
+// compiled in with -DNWNLTR_EMBEDDED=\"file\"
+void emit_c(const char *dir, int nofix) {
+    struct ltr_registry registry;
+    ltr_registry_load(&registry, dir, nofix, 0);
+
+    printf("// Generated by nwnltr --emit-c from %s. Do not edit.\n", dir);
+    printf("#if NUM_LETTERS != %d\n#error \"Tables were generated with NUM_LETTERS=%d\"\n#endif\n",
+           NUM_LETTERS, NUM_LETTERS);
+    for (size_t t = 0; t < registry.count; t++) {
+        char id[256];
+        snprintf(id, sizeof(id), "%s", registry.names[t]);
+        for (char *p = id; *p; p++)
+            *p = isalnum((uint8_t)*p) ? tolower((uint8_t)*p) : '_';
+
+        build_compact(registry.tables[t]);
+        const struct ltr_compact *c = registry.tables[t]->compact;
+        // One extra entry, so no array is empty
+        printf("\nstatic const uint8_t ltr_%s_letters[%zu] = {", id, c->size + 1);
+        for (size_t i = 0; i < c->size; i++)
+            printf("%s%u,", i % 24 ? "" : "\n    ", c->letters[i]);
+        printf("0\n};\nstatic const float ltr_%s_values[%zu] = {", id, c->size + 1);
+        for (size_t i = 0; i < c->size; i++)
+            printf("%s%a,", i % 6 ? " " : "\n    ", c->values[i]);
+        printf("0\n};\nstatic const struct ltr_compact ltr_%s = {\n    {", id);
+        for (int i = 0; i < NUM_CONTEXTS; i++)
+            printf("%s{%u,{%u,%u,%u}},", i % 6 ? "" : "\n     ", c->contexts[i].offset,
+                   c->contexts[i].count[0], c->contexts[i].count[1], c->contexts[i].count[2]);
+        printf("\n    },\n    ltr_%s_letters, ltr_%s_values, %zu\n};\n", id, id, c->size);
+        free_ltr(registry.tables[t]);
+    }
+
+    printf("\nstatic const struct ltr_embedded ltr_embedded[] = {\n");
+    for (size_t t = 0; t < registry.count; t++) {
+        char id[256];
+        snprintf(id, sizeof(id), "%s", registry.names[t]);
+        for (char *p = id; *p; p++)
+            *p = isalnum((uint8_t)*p) ? tolower((uint8_t)*p) : '_';
+        printf("    { \"%s\", &ltr_%s },\n", registry.names[t], id);
+    }
+    printf("};\n");
 }
 
 int main(int argc, char *argv[]) {
-    struct ltrfile ltr;
+    static struct ltrfile ltr;
+    struct build_stats build_stats = {0};
+    struct rng_state rng;
     parse_cmdline(argc, argv);
 
-    srand(cfg.seed ? cfg.seed : time(NULL));
+    enum rng_kind kind = cfg.game_exact ? RNG_LIBC : RNG_XOSHIRO;
+    if (cfg.rng) {
+        for (kind = 0; kind < sizeof(rng_names)/sizeof(rng_names[0]); kind++)
+            if (!strcmp(cfg.rng, rng_names[kind]))
+                break;
+        if (kind == sizeof(rng_names)/sizeof(rng_names[0]))
+            die("Unknown RNG '%s'", cfg.rng);
+    }
+    rng_seed(&rng, kind, cfg.seed ? cfg.seed : time(NULL));
+
+    if (cfg.emit_c) {
+        emit_c(cfg.ltrfile, cfg.nofix);
+        return 0;
+    }
+
+    if (cfg.bench) {
+        bench(cfg.ltrfile, &rng, cfg.generate > 0 ? (size_t)cfg.generate : BENCH_NAMES);
+        return 0;
+    }
+
+    if (cfg.update || cfg.nmerge || (cfg.build && cfg.counts)) {
+        struct ltrcounts *counts = calloc(1, sizeof(*counts));
+        char *cntfile = counts_filename(cfg.ltrfile);
+        if (!counts)
+            die("Out of memory");
+        if (cfg.update)
+            load_counts(cntfile, counts);
+        for (int i = 0; i < cfg.nmerge; i++)
+            load_counts(cfg.merge[i], counts);
+        if (cfg.build || cfg.update)
+            count_input(counts, cfg.input, cfg.jobs, &build_stats);
 
-    if (cfg.build)
-        build_ltr(cfg.ltrfile, &ltr);
+        ltr_from_counts(&ltr, counts);
+        write_ltr(cfg.ltrfile, &ltr);
+        write_counts(cntfile, counts);
+        free(cntfile);
+        free(counts);
+    }
+    else if (cfg.build)
+        build_ltr(cfg.ltrfile, cfg.input, cfg.jobs, &ltr, &build_stats);
+    else if (cfg.table) {
+        static struct ltr_registry registry;
+#ifdef NWNLTR_EMBEDDED
+        if (!strcmp(cfg.ltrfile, "-"))
+            ltr_registry_load_embedded(&registry);
+        else
+#endif
+        ltr_registry_load(&registry, cfg.ltrfile, 1, 0);
+        const struct ltrfile *table = ltr_registry_find(&registry, cfg.table, NULL);
+        if (!table) {
+            fprintf(stderr, "No table %s in %s. Available:", cfg.table, cfg.ltrfile);
+            for (size_t i = 0; i < registry.count; i++)
+                fprintf(stderr, " %s", registry.names[i]);
+            die("");
+        }
+        ltr = *table;
+        // The compiled in tables were fixed (or not) by --emit-c
+        if (ltr.compact && (cfg.print || !cfg.game_exact))
+            ltr_from_compact(&ltr);
+        if (ltr.compact)
+            cfg.nofix = 1;
+    }
     else
         load_ltr(cfg.ltrfile, &ltr);
 
@@ -458,8 +1970,61 @@ int main(int argc, char *argv[]) {
     if (cfg.print)
         print_ltr(&ltr);
 
-    while (cfg.generate-- > 0)
-        printf("%s\n", random_name(&ltr));
+    if (cfg.generate && !cfg.game_exact)
+        build_sampler(&ltr);
+    else if (cfg.generate && !ltr.compact)
+        build_compact(&ltr);
+
+    static struct namefilter namefilter;
+    struct namefilter *filter = NULL;
+    if (cfg.unique || cfg.exclude) {
+        filter = &namefilter;
+        filter->unique = cfg.unique;
+        if (cfg.exclude)
+            nameset_load(&filter->set, cfg.exclude);
+    }
+
+    size_t count = cfg.generate > 0 ? cfg.generate : 0;
+    if (cfg.jobs > 1 && count) {
+        if (rng.kind == RNG_LIBC)
+            die("The libc RNG is not thread safe, and can't be used with --jobs");
+        generate_parallel(&ltr, &rng, count, cfg.jobs, filter, &rng.stats);
+        count = 0;
+    }
+
+    static char buf[1 << 16];
+    while (count) {
+        size_t used;
+        if (filter) {
+            ltr_generate_batch(&ltr, &rng, SIZE_MAX, buf, sizeof(buf), &used);
+            write_names(filter, buf, used, &count);
+        } else {
+            count -= ltr_generate_batch(&ltr, &rng, count, buf, sizeof(buf), &used);
+            write_names(NULL, buf, used, &count);
+        }
+    }
+
+    if (cfg.stats) {
+        const struct ltr_stats *st = &rng.stats;
+        double n = st->names ? st->names : 1;
+        fflush(stdout);
+        if (cfg.build || cfg.update)
+            fprintf(stderr, "build_names=%llu invalid_chars=%llu short_names=%llu%s",
+                    (unsigned long long)build_stats.names, (unsigned long long)build_stats.invalid_chars,
+                    (unsigned long long)build_stats.short_names, cfg.generate ? " " : "\n");
+        if (cfg.generate) {
+            fprintf(stderr, "names=%llu draws=%llu restarts=%llu bailouts=%llu backoffs=%llu"
+                    " draws_per_name=%.4f restarts_per_name=%.4f backoffs_per_name=%.4f",
+                    (unsigned long long)st->names, (unsigned long long)st->draws,
+                    (unsigned long long)st->restarts, (unsigned long long)st->bailouts,
+                    (unsigned long long)st->backoffs,
+                    st->draws / n, st->restarts / n, st->backoffs / n);
+            if (ltr.sampler)
+                fprintf(stderr, " dead_contexts=%d", ltr.sampler->dead);
+            fprintf(stderr, "\n");
+        }
+    }
 
     return 0;
 }
+#endif
@@ -4,29 +4,99 @@
 //    - Decode a nwserver (linux or windows) stack trace to human readable symbols
 //
 // To compile, use any of:
-//    make nwserver-dump-decode
-//    cc -o nwserver-dump-decode nwserver-dump-decode.c
+//    make nwserver-dump-decode LDLIBS=-pthread
+//    cc -o nwserver-dump-decode nwserver-dump-decode.c -pthread
+//
+// Add -DDECODE_PROFILE to time each stage (autodetect, loading, reading,
+// parsing, lookups and output) and print a summary on stderr at exit.
 //
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 
 #define HELP \
 "NWN nwserver stacktrace decoding tool\n" \
-"Usage: nwserver-dump-decode [OPTIONS]\n" \
+"Usage: nwserver-dump-decode [OPTIONS] [DUMPFILE...]\n" \
 "Options:\n" \
 " -h, --help          Print this help command\n" \
-" -d, --dumpfile      Path to the dump file to decode. Defaults to stdin if not specified\n" \
+" -d, --dumpfile      Path to the dump file to decode. Defaults to stdin if not specified.\n" \
+"                     Any number of dump files can also be given as plain arguments\n" \
 " -f, --funcfile      Path to the functions.hpp file. Will attempt to auto detect if not specified\n" \
 " -r, --repeat-input  Will print all non-decoded input lines over to output.\n" \
 " -a, --autodetect    Try to automatically detect the <FUNCTIONS_FILE>\n" \
+" -s, --suffix        Write the output for each dump file to <DUMPFILE><SUFFIX> instead of stdout\n" \
+" -R, --raw           Input is raw hex offsets only (e.g. profiler samples), one per line.\n" \
+"                     Needs --funcfile\n" \
+"     --aggregate     Instead of decoding, count hits per function and per function+offset\n" \
+"                     across all input and print the most frequent ones\n" \
+"     --top NUM       Number of entries printed by --aggregate. Default 20, 0 for all\n" \
+"     --folded        Instead of decoding, fold each backtrace into a single line of\n" \
+"                     'outermost;...;innermost count', merging identical stacks, for use\n" \
+"                     with flame graph tools. With --raw, blank lines separate stacks\n" \
+"     --max-gap SIZE  Don't attribute offsets more than SIZE bytes past the start of a function\n" \
+"                     (hex with 0x prefix, or decimal). This also bounds the last function,\n" \
+"                     which is otherwise never attributed since its end is unknown\n" \
+"     --bench         Time loading the functions file given with -f (by default the 8186\n" \
+"                     ones in extra/offsets), lookups and decoding synthetic logs, and\n" \
+"                     check lookups against a linear search. Exits with 1 on mismatches\n" \
+"     --no-cache      Don't use or update the autodetect cache of functions file paths.\n" \
+"                     Detected paths are kept in $XDG_CACHE_HOME/nwserver-dump-decode.paths\n" \
+"                     (~/.cache by default) and reused while the file is unchanged\n" \
+" -v, --verbose       Report symbol table load statistics and timing on stderr\n" \
+" -j, --jobs          Number of dump files to decode in parallel. Output order is preserved. Default 1\n" \
+"     --resolve NAME  Print the offset of function NAME, or of all functions matching a\n" \
+"                     glob such as 'CNWSCreature__*', as 'BUILD OS NAME OFFSET'. Can\n" \
+"                     be repeated; NAME - reads names and patterns from stdin, one per\n" \
+"                     line. Needs --funcfile\n" \
+"     --all-builds    Load every Functions*-BUILD.hpp in the offsets directory and decode\n" \
+"                     each offset against all of them, printing one\n" \
+"                     'OFFSET BUILD OS FUNCTION+DELTA' line per build it falls in.\n" \
+"                     With --resolve, look the names up in every build\n" \
+"     --diff          Print the functions added, removed, moved or resized between each\n" \
+"                     pair of consecutive builds in the offsets directory\n" \
+"     --offsets-dir DIR  Directory for --all-builds and --diff. Default extra/offsets\n" \
+"     --serve         Answer decode requests on stdin/stdout, one per line, with the\n" \
+"                     functions file from -f, or all builds in the offsets directory,\n" \
+"                     loaded up front. Requests: 'decode BUILD linux|windows OFFSET...',\n" \
+"                     'file PATH', 'log N' followed by N lines of crash log, 'ping' and\n" \
+"                     'quit'. Answers are 'OK N' and N lines, or 'ERR message'\n" \
+"     --socket PATH   Like --serve, on connections to a Unix socket at PATH\n" \
+"     --compile-index Compile the functions file given with -f into a binary .nwsym index\n" \
+"                     stored next to it. Autodetect prefers an up to date .nwsym over the .hpp\n" \
 "\n" \
 "Example usages:\n" \
 "  Decode a crash dump with autodetcting the offsets:\n" \
 "    nwserver-dump-decode -r -a < nwserver-crash-1543867203.log\n" \
 "  Decode a crash dump with manually specifying the offsets:\n" \
-"    nwserver-dump-decode -r -d nwserver-crash-1543867203.log -f ~/nwnx/NWNXLib/API/FunctionsLinux.hpp\n"
+"    nwserver-dump-decode -r -d nwserver-crash-1543867203.log -f ~/nwnx/NWNXLib/API/FunctionsLinux.hpp\n" \
+"  Decode a batch of crash dumps, possibly from different builds, to .txt files:\n" \
+"    nwserver-dump-decode -r -a -j 8 -s .txt nwserver-crash-*.log\n" \
+"  Find the functions appearing most in a week of crash dumps:\n" \
+"    nwserver-dump-decode -a -j 8 --aggregate --top 50 nwserver-crash-*.log\n" \
+"  Build a flame graph from sampled stacks:\n" \
+"    nwserver-dump-decode -R --folded -f FunctionsLinux-8186.hpp < samples.txt | flamegraph.pl > out.svg\n" \
+"  Find the offsets of all CNWSCreature methods:\n" \
+"    nwserver-dump-decode -f FunctionsLinux-8186.hpp --resolve 'CNWSCreature__*'\n" \
+"  Keep all builds loaded and decode crash logs on request:\n" \
+"    nwserver-dump-decode -r --all-builds --socket /tmp/decode.sock &\n" \
+"    printf 'file nwserver-crash-1543867203.log\\n' | nc -U /tmp/decode.sock\n" \
+"  Precompile the offsets for faster startup:\n" \
+"    nwserver-dump-decode --compile-index -f extra/offsets/FunctionsLinux-8186.hpp\n"
 
 
 #define die(format, ...)                                \
@@ -35,14 +105,109 @@
         exit(~0);                                       \
     } while(0)
 
+#define DEFAULT_TOP 20
+
 struct args {
     int   repeat;
     int   autodetect;
-    char *dumpfile;
+    int   compile_index;
+    int   verbose;
+    int   raw;
+    int   aggregate;
+    int   folded;
+    int   bench;
+    int   no_cache;
+    int   serve;
+    char *socket;
+    int   all_builds;
+    int   diff;
+    char *offsets_dir;
+    int   nresolve;
+    char **resolve;
+    int   top;
+    uint32_t max_gap;
+    int   jobs;
+    int   ndumpfiles;
+    char **dumpfiles;
     char *funcfile;
+    char *suffix;
 } args;
 
+// Stage timings for -DDECODE_PROFILE. Each thread adds into its own copy,
+// which profile_flush() adds to the totals, so the hot paths take no locks.
+// PROFILE_BEGIN()/PROFILE_END() compile to nothing without the flag.
+#ifdef DECODE_PROFILE
+enum profile_stage {
+    PROF_DETECT, PROF_LOAD, PROF_SORT, PROF_READ, PROF_PARSE, PROF_LOOKUP, PROF_OUTPUT, PROF_STAGES
+};
+static const char *const profile_names[PROF_STAGES] = {
+    "autodetect", "load", "  qsort", "read", "parse", "lookup", "output"
+};
+struct profile {
+    uint64_t ns[PROF_STAGES];
+    uint64_t calls[PROF_STAGES];
+    uint64_t lines;
+};
+static struct profile profile_total;
+static __thread struct profile profile_local;
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static pid_t profile_pid;
+
+static inline uint64_t profile_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+#define PROFILE_BEGIN(var) uint64_t profile_##var = profile_now()
+#define PROFILE_END(stage, var)                                 \
+    do {                                                        \
+        profile_local.ns[stage] += profile_now() - profile_##var; \
+        profile_local.calls[stage]++;                           \
+    } while (0)
+#define PROFILE_LINE() (profile_local.lines++)
+
+static void profile_flush(void) {
+    pthread_mutex_lock(&profile_lock);
+    for (int i = 0; i < PROF_STAGES; i++) {
+        profile_total.ns[i]    += profile_local.ns[i];
+        profile_total.calls[i] += profile_local.calls[i];
+    }
+    profile_total.lines += profile_local.lines;
+    pthread_mutex_unlock(&profile_lock);
+    memset(&profile_local, 0, sizeof(profile_local));
+}
+
+// Registered with atexit() by main. The --serve children exit too, but only
+// the main process reports.
+static void profile_report(void) {
+    if (getpid() != profile_pid)
+        return;
+    profile_flush();
+    const struct profile *p = &profile_total;
+    fprintf(stderr, "\nProfile: %llu input lines\n", (unsigned long long)p->lines);
+    fprintf(stderr, "%-12s %12s %12s %12s %12s\n", "stage", "calls", "total ms", "ns/call", "ns/line");
+    for (int i = 0; i < PROF_STAGES; i++) {
+        fprintf(stderr, "%-12s %12llu %12.3f %12.1f %12.1f\n", profile_names[i],
+                (unsigned long long)p->calls[i], p->ns[i] / 1e6,
+                p->calls[i] ? (double)p->ns[i] / p->calls[i] : 0.0,
+                p->lines ? (double)p->ns[i] / p->lines : 0.0);
+    }
+}
+#else
+#define PROFILE_BEGIN(var)
+#define PROFILE_END(stage, var)
+#define PROFILE_LINE()
+#define profile_flush()
+#endif
+
 void parse_cmdline(int argc, char *argv[]) {
+    args.top = DEFAULT_TOP;
+    args.dumpfiles = calloc(argc, sizeof(*args.dumpfiles));
+    args.resolve = calloc(argc, sizeof(*args.resolve));
+    if (!args.dumpfiles || !args.resolve)
+        die("Out of memory");
+
     for (int i = 1; i < argc; i++) {
         if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
             printf(HELP);
@@ -51,93 +216,707 @@ void parse_cmdline(int argc, char *argv[]) {
 
         args.repeat |= !strcmp(argv[i], "-r") || !strcmp(argv[i], "--repeat-input");
         args.autodetect |= !strcmp(argv[i], "-a") || !strcmp(argv[i], "--autodetect");
+        args.compile_index |= !strcmp(argv[i], "--compile-index");
+        args.verbose |= !strcmp(argv[i], "-v") || !strcmp(argv[i], "--verbose");
+        args.raw |= !strcmp(argv[i], "-R") || !strcmp(argv[i], "--raw");
+        args.aggregate |= !strcmp(argv[i], "--aggregate");
+        args.folded |= !strcmp(argv[i], "--folded");
+        args.bench |= !strcmp(argv[i], "--bench");
+        args.no_cache |= !strcmp(argv[i], "--no-cache");
+        args.serve |= !strcmp(argv[i], "--serve");
+        args.all_builds |= !strcmp(argv[i], "--all-builds");
+        args.diff |= !strcmp(argv[i], "--diff");
 
         if (!strcmp(argv[i], "-d") || !strcmp(argv[i], "--dumpfile")) {
             if (i == argc-1)
                 die("Bad argument - Need file name with -d / --dumpfile");
-            args.dumpfile = argv[++i];
+            args.dumpfiles[args.ndumpfiles++] = argv[++i];
+            continue;
         }
         if (!strcmp(argv[i], "-f") || !strcmp(argv[i], "--funcfile")) {
             if (i == argc-1)
                 die("Bad argument - Need file name with -f / --funcfile");
             args.funcfile = argv[++i];
+            continue;
         }
+        if (!strcmp(argv[i], "--socket")) {
+            if (i == argc-1)
+                die("Bad argument - Need a path with --socket");
+            args.socket = argv[++i];
+            args.serve = 1;
+            continue;
+        }
+        if (!strcmp(argv[i], "--offsets-dir")) {
+            if (i == argc-1)
+                die("Bad argument - Need a directory with --offsets-dir");
+            args.offsets_dir = argv[++i];
+            continue;
+        }
+        if (!strcmp(argv[i], "--resolve")) {
+            if (i == argc-1)
+                die("Bad argument - Need a function name or pattern with --resolve");
+            args.resolve[args.nresolve++] = argv[++i];
+            continue;
+        }
+        if (!strcmp(argv[i], "-s") || !strcmp(argv[i], "--suffix")) {
+            if (i == argc-1)
+                die("Bad argument - Need file suffix with -s / --suffix");
+            args.suffix = argv[++i];
+            continue;
+        }
+        if (!strcmp(argv[i], "-j") || !strcmp(argv[i], "--jobs")) {
+            if (i == argc-1 || sscanf(argv[i+1], "%d", &args.jobs) != 1 || args.jobs < 1)
+                die("Bad argument - Need number of jobs with -j / --jobs");
+            i++;
+            continue;
+        }
+        if (!strcmp(argv[i], "--max-gap")) {
+            char *end;
+            if (i == argc-1 || !(args.max_gap = strtoul(argv[i+1], &end, 0)) || *end)
+                die("Bad argument - Need a nonzero size with --max-gap");
+            i++;
+            continue;
+        }
+        if (!strcmp(argv[i], "--top")) {
+            if (i == argc-1 || sscanf(argv[i+1], "%d", &args.top) != 1 || args.top < 0)
+                die("Bad argument - Need number of entries with --top");
+            i++;
+            continue;
+        }
+        if (argv[i][0] != '-')
+            args.dumpfiles[args.ndumpfiles++] = argv[i];
     }
 
-    if (args.autodetect && args.funcfile)
+    if (args.aggregate && args.folded)
+        die("Bad arguments: --aggregate and --folded are mutually exclusive");
+    if ((args.aggregate || args.folded) && args.suffix)
+        die("Bad arguments: --aggregate and --folded print a single summary and can't be used with --suffix");
+    if (args.suffix && !args.ndumpfiles)
+        die("Bad arguments: --suffix needs at least one dump file");
+
+    if (args.compile_index && !args.funcfile)
+        die("Bad arguments: --compile-index needs the functions file given with --funcfile");
+    if (args.serve && (args.raw || args.aggregate || args.folded || args.suffix || args.diff || args.nresolve || args.ndumpfiles))
+        die("Bad arguments: --serve only takes -f, -a, -r, --all-builds, --offsets-dir and --socket");
+    if (args.diff || args.offsets_dir)
+        args.all_builds = 1;
+    if (!args.offsets_dir)
+        args.offsets_dir = "extra/offsets";
+    if (args.all_builds && args.funcfile)
+        die("Bad arguments: --all-builds and --funcfile are mutually exclusive");
+    if (args.all_builds && (args.raw || args.aggregate || args.folded || args.suffix))
+        die("Bad arguments: --all-builds can't be used with --raw, --aggregate, --folded or --suffix");
+    if (args.nresolve && !args.funcfile && !args.all_builds)
+        die("Bad arguments: --resolve needs the functions file given with --funcfile, or --all-builds");
+    if (args.raw && !args.funcfile)
+        die("Bad arguments: --raw needs the functions file given with --funcfile");
+    if (args.bench)
+        args.autodetect = 0;
+    else if (args.autodetect && args.funcfile)
         die("Bad arguments: --autodetect and --funcfile are mutually exclusive");
     else if (!args.funcfile)
         args.autodetect = 1;
 }
 
-#define MAX_FUNCTIONS 10000
-struct function {
-    char name[256];
+// Symbol table, stored as a struct of arrays so that the offsets being
+// searched are dense. Names live in a single string pool and are referenced
+// by their position in it. All arrays grow as needed.
+// A table loaded from a .nwsym index points straight into the mapped file.
+struct symtab {
+    int       build;    // NWNX_EXPECT_VERSION of the source header, 0 if unknown
+    int       os;       // 0 = linux, 1 = windows
+    uint32_t  count;
+    uint32_t  capacity;
+    uint32_t *offsets;  // sorted function start offsets
+    uint32_t *names;    // names[i] is the position of function i's name in strings
+    uint32_t *ends;     // end (exclusive) of function i, see symtab_set_ends()
+    uint32_t *by_name;  // function indices sorted by name, see symtab_name_index()
+    char     *strings;
+    uint32_t  strings_size;
+    uint32_t  strings_capacity;
+    void     *mapping;
+    size_t    mapping_size;
+};
+
+// On-disk layout of a .nwsym index, in host byte order (it is a local cache,
+// rebuilt with --compile-index rather than shared between machines):
+//   struct nwsym_header
+//   uint32_t offsets[count]  - sorted
+//   uint32_t names[count]
+//   char     strings[strings_size]
+#define NWSYM_MAGIC "NWSYM\0\0\1"
+struct nwsym_header {
+    char     magic[8];
+    uint32_t build;
+    uint32_t os;
+    uint32_t count;
+    uint32_t strings_size;
+};
+
+#define symbol_name(t, i) (&(t)->strings[(t)->names[i]])
+
+static void *xrealloc(void *ptr, size_t size) {
+    ptr = realloc(ptr, size);
+    if (!ptr)
+        die("Out of memory");
+    return ptr;
+}
+
+static void symtab_add(struct symtab *t, const char *name, uint32_t namelen, uint32_t offset) {
+    uint32_t len = namelen + 1;
+    if (t->count == t->capacity) {
+        t->capacity = t->capacity ? t->capacity * 2 : 4096;
+        t->offsets = xrealloc(t->offsets, t->capacity * sizeof(*t->offsets));
+        t->names   = xrealloc(t->names,   t->capacity * sizeof(*t->names));
+    }
+    while (t->strings_size + len > t->strings_capacity) {
+        t->strings_capacity = t->strings_capacity ? t->strings_capacity * 2 : 65536;
+        t->strings = xrealloc(t->strings, t->strings_capacity);
+    }
+    memcpy(&t->strings[t->strings_size], name, namelen);
+    t->strings[t->strings_size + namelen] = '\0';
+    t->offsets[t->count] = offset;
+    t->names[t->count]   = t->strings_size;
+    t->strings_size += len;
+    t->count++;
+}
+
+struct sortkey {
     uint32_t offset;
-} *functions;
-uint32_t fcount;
+    uint32_t name;
+};
 
 int cmp(const void *a, const void *b) {
-    const struct function *f1 = a, *f2 = b;
+    const struct sortkey *f1 = a, *f2 = b;
     return (int64_t)f1->offset - (int64_t)f2->offset;
 }
 
-void load_functions(const char *infile) {
-    FILE *f = fopen(infile, "r");
+static void symtab_sort(struct symtab *t) {
+    struct sortkey *keys = xrealloc(NULL, t->count * sizeof(*keys) + 1);
+    for (uint32_t i = 0; i < t->count; i++)
+        keys[i] = (struct sortkey){ t->offsets[i], t->names[i] };
+
+    PROFILE_BEGIN(sort);
+    qsort(keys, t->count, sizeof(*keys), cmp);
+    PROFILE_END(PROF_SORT, sort);
+
+    for (uint32_t i = 0; i < t->count; i++) {
+        t->offsets[i] = keys[i].offset;
+        t->names[i]   = keys[i].name;
+    }
+    free(keys);
+}
+
+#define starts_with(str1, str2) (!strncmp(str1, str2, strlen(str2)))
+
+static int ends_with(const char *str, const char *suffix) {
+    size_t len = strlen(str), slen = strlen(suffix);
+    return len >= slen && !strcmp(str + len - slen, suffix);
+}
+
+// Reports a functions file that can't be loaded; the caller returns NULL so
+// that one bad file doesn't stop the dumps that don't need it
+#define load_error(format, ...) fprintf(stderr, format "\n", ##__VA_ARGS__)
+
+// Returns NULL if the index is missing or invalid
+struct symtab *load_index(const char *infile) {
+    int fd = open(infile, O_RDONLY);
+    if (fd < 0) {
+        load_error("Input file '%s' not found", infile);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) || (size_t)st.st_size < sizeof(struct nwsym_header)) {
+        close(fd);
+        load_error("Index file '%s' is truncated", infile);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        load_error("Unable to map index file '%s'", infile);
+        return NULL;
+    }
+
+    const struct nwsym_header *hdr = map;
+    size_t expected = sizeof(*hdr) + 2 * (size_t)hdr->count * sizeof(uint32_t) + hdr->strings_size;
+    if (memcmp(hdr->magic, NWSYM_MAGIC, sizeof(hdr->magic))) {
+        load_error("File '%s' is not a valid .nwsym index", infile);
+        goto fail;
+    }
+    if ((size_t)st.st_size != expected || !hdr->strings_size) {
+        load_error("Index file '%s' is corrupt (size %zu, expected %zu)", infile, (size_t)st.st_size, expected);
+        goto fail;
+    }
+
+    const uint32_t *offsets = (const uint32_t *)(hdr + 1);
+    const uint32_t *names   = offsets + hdr->count;
+    const char *strings     = (const char *)(names + hdr->count);
+    if (strings[hdr->strings_size - 1] != '\0') {
+        load_error("Index file '%s' is corrupt (unterminated string pool)", infile);
+        goto fail;
+    }
+    for (uint32_t i = 0; i < hdr->count; i++) {
+        if (names[i] >= hdr->strings_size || (i > 0 && offsets[i] < offsets[i-1])) {
+            load_error("Index file '%s' is corrupt (bad entry %u)", infile, i);
+            goto fail;
+        }
+    }
+
+    struct symtab *t = calloc(1, sizeof(*t));
+    if (!t)
+        die("Out of memory");
+
+    t->build        = hdr->build;
+    t->os           = hdr->os;
+    t->count        = hdr->count;
+    t->offsets      = (uint32_t *)offsets;
+    t->names        = (uint32_t *)names;
+    t->strings      = (char *)strings;
+    t->strings_size = hdr->strings_size;
+    t->mapping      = map;
+    t->mapping_size = st.st_size;
+    return t;
+
+fail:
+    munmap(map, st.st_size);
+    return NULL;
+}
+
+void write_index(const struct symtab *t, const char *outfile) {
+    FILE *f = fopen(outfile, "wb");
     if (!f)
-        die("Input file '%s' not found", infile);
+        die("Unable to create index file '%s'", outfile);
 
-    functions = malloc(MAX_FUNCTIONS * sizeof(*functions));
-    if (!functions)
-         die("Out of memory");
+    struct nwsym_header hdr = { .build = t->build, .os = t->os, .count = t->count, .strings_size = t->strings_size };
+    memcpy(hdr.magic, NWSYM_MAGIC, sizeof(hdr.magic));
 
-    char buf[1024];
-    while (fgets(buf, 1024, f))
-        fcount += (sscanf(buf, "constexpr%*[ \t]uintptr_t%*[ \t]%s%*[ \t]=%*[ \t]%x;", functions[fcount].name, &functions[fcount].offset) == 2);
+    if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+        fwrite(t->offsets, sizeof(*t->offsets), t->count, f) != t->count ||
+        fwrite(t->names, sizeof(*t->names), t->count, f) != t->count ||
+        fwrite(t->strings, 1, t->strings_size, f) != t->strings_size)
+        die("Unable to write index file '%s'", outfile);
 
+    if (fclose(f))
+        die("Unable to write index file '%s'", outfile);
+}
+
+// Reads just the build number out of a .nwsym header, 0 if not a valid index
+static int index_build(const char *path) {
+    struct nwsym_header hdr;
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return 0;
+    int ok = fread(&hdr, sizeof(hdr), 1, f) == 1 && !memcmp(hdr.magic, NWSYM_MAGIC, sizeof(hdr.magic));
     fclose(f);
+    return ok ? (int)hdr.build : 0;
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
 
-    qsort(functions, fcount, sizeof(*functions), cmp);
+#define is_blank(c) ((c) == ' ' || (c) == '\t')
+
+// Matches word at *p followed by at least one blank, and skips the blanks
+static int match_word(const char **p, const char *end, const char *word, size_t len) {
+    const char *q = *p;
+    if ((size_t)(end - q) <= len || memcmp(q, word, len) || !is_blank(q[len]))
+        return 0;
+    for (q += len; q < end && is_blank(*q); q++);
+    *p = q;
+    return 1;
+}
+
+// Parses an optionally 0x prefixed hex number; returns 0 if there are no digits
+static int parse_hex(const char **p, const char *end, uint32_t *value) {
+    const char *q = *p;
+    uint32_t v = 0;
+    if (end - q > 2 && q[0] == '0' && (q[1] == 'x' || q[1] == 'X') && isxdigit((unsigned char)q[2]))
+        q += 2;
+    const char *digits = q;
+    for (; q < end; q++) {
+        unsigned c = (unsigned char)*q;
+        if (c - '0' < 10)               v = (v << 4) | (c - '0');
+        else if ((c | 0x20) - 'a' < 6)  v = (v << 4) | ((c | 0x20) - 'a' + 10);
+        else break;
+    }
+    *p = q;
+    *value = v;
+    return q != digits;
 }
 
-uint32_t lookup(uint32_t offset) {
-    for (uint32_t i = 1; i < fcount; i++) {
-        if (functions[i].offset > offset) {
-            return i-1;
+// Single pass scanner over the whole header mapped in memory. Recognizes lines
+// of the form "constexpr uintptr_t NAME = 0xHEX;" and "NWNX_EXPECT_VERSION(N);"
+// at the start of a line; names of any length are accepted.
+static void scan_functions(struct symtab *t, const char *p, const char *end) {
+    while (p < end) {
+        const char *eol = memchr(p, '\n', end - p);
+        if (!eol)
+            eol = end;
+
+        const char *q = p;
+        if (match_word(&q, eol, "constexpr", 9) && match_word(&q, eol, "uintptr_t", 9)) {
+            const char *name = q;
+            while (q < eol && !isspace((unsigned char)*q))
+                q++;
+            uint32_t namelen = q - name;
+            uint32_t offset;
+            while (q < eol && is_blank(*q))
+                q++;
+            if (namelen && q > name + namelen && q < eol && *q == '=') {
+                for (q++; q < eol && isspace((unsigned char)*q); q++);
+                if (parse_hex(&q, eol, &offset))
+                    symtab_add(t, name, namelen, offset);
+            }
+        } else if (!t->build && (size_t)(eol - q) > 20 && !memcmp(q, "NWNX_EXPECT_VERSION(", 20)) {
+            int build = 0;
+            for (q += 20; q < eol && is_blank(*q); q++);
+            for (; q < eol && *q >= '0' && *q <= '9' && build < 1000000; q++)
+                build = build * 10 + (*q - '0');
+            t->build = build;
         }
+
+        p = eol + 1;
     }
-    return ~0;
 }
-char *decode(uint32_t offset) {
-    static char out[1024];
-    uint32_t idx = lookup(offset);
-    if (idx != ~0) {
-        sprintf(out, "%s+0x%x", functions[idx].name, offset - functions[idx].offset);
-        return out;
+
+// Returns NULL if the header can't be read
+struct symtab *parse_functions(const char *infile) {
+    int fd = open(infile, O_RDONLY);
+    if (fd < 0) {
+        load_error("Input file '%s' not found", infile);
+        return NULL;
     }
-    return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st)) {
+        close(fd);
+        load_error("Unable to read input file '%s'", infile);
+        return NULL;
+    }
+
+    struct symtab *t = calloc(1, sizeof(*t));
+    if (!t)
+        die("Out of memory");
+
+    t->os = strstr(infile, "Windows") != NULL;
+
+    if (st.st_size > 0) {
+        const char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            close(fd);
+            free(t);
+            load_error("Unable to map input file '%s'", infile);
+            return NULL;
+        }
+        madvise((void *)map, st.st_size, MADV_SEQUENTIAL);
+        scan_functions(t, map, map + st.st_size);
+        munmap((void *)map, st.st_size);
+    }
+    close(fd);
+
+    symtab_sort(t);
+    return t;
 }
 
-char *try_parse(char *buf) {
-    static char out[1024];
-    char tmp[1024] = "";
-    uint32_t offset = 0;
-
-    if (sscanf(buf, "%X", &offset)) {
-        return decode(offset);
-    } else if (sscanf(buf, "./nwserver-linux(+0x%x)%[^\n]", &offset, tmp)) {
-        char *dec = decode(offset);
-        if (dec) {
-            sprintf(out, "./nwserver-linux(%s)%s", dec, tmp);
-            return out;
+// Each function ends where the next one starts, capped to --max-gap bytes.
+// The size of the last function is unknown, so it is empty unless capped.
+static void symtab_set_ends(struct symtab *t) {
+    t->ends = xrealloc(NULL, t->count * sizeof(*t->ends) + 1);
+    for (uint32_t i = 0; i < t->count; i++) {
+        uint64_t end = (i + 1 < t->count) ? t->offsets[i+1] : t->offsets[i];
+        uint64_t cap = (uint64_t)t->offsets[i] + args.max_gap;
+        if (args.max_gap && (cap < end || i + 1 == t->count))
+            end = cap;
+        t->ends[i] = end > UINT32_MAX ? UINT32_MAX : (uint32_t)end;
+    }
+}
+
+#define symbol_size(t, i) ((t)->ends[i] - (t)->offsets[i])
+
+// Returns NULL, having said why, if infile can't be loaded
+struct symtab *load_functions(const char *infile) {
+    double start = now_ms();
+    PROFILE_BEGIN(load);
+    struct symtab *t = ends_with(infile, ".nwsym") ? load_index(infile) : parse_functions(infile);
+    if (!t)
+        return NULL;
+    symtab_set_ends(t);
+    PROFILE_END(PROF_LOAD, load);
+
+    if (args.verbose) {
+        fprintf(stderr, "Loaded %u symbols (build %d, %s, %u bytes of names) from '%s' in %.3f ms\n",
+                t->count, t->build, t->os ? "windows" : "linux", t->strings_size, infile, now_ms() - start);
+    }
+    return t;
+}
+
+void free_symtab(struct symtab *t) {
+    if (t->mapping) {
+        munmap(t->mapping, t->mapping_size);
+    } else {
+        free(t->offsets);
+        free(t->names);
+        free(t->strings);
+    }
+    free(t->ends);
+    free(t->by_name);
+    free(t);
+}
+
+// Sorts the function indices by name for resolve(), on first use
+static const struct symtab *name_sort_table;
+static int namecmp(const void *a, const void *b) {
+    const struct symtab *t = name_sort_table;
+    return strcmp(symbol_name(t, *(const uint32_t *)a), symbol_name(t, *(const uint32_t *)b));
+}
+
+static void symtab_name_index(struct symtab *t) {
+    if (t->by_name)
+        return;
+    t->by_name = xrealloc(NULL, t->count * sizeof(*t->by_name) + 1);
+    for (uint32_t i = 0; i < t->count; i++)
+        t->by_name[i] = i;
+    name_sort_table = t;
+    qsort(t->by_name, t->count, sizeof(*t->by_name), namecmp);
+}
+
+// Prints the offsets of all functions matching pattern, which is either a
+// name or a shell glob such as CNWSCreature__*. Only the names starting with
+// the part before the first wildcard need to be matched, and those are
+// adjacent in the name index. Returns the number of matches.
+int resolve(struct symtab *t, const char *pattern) {
+    size_t prefix = strcspn(pattern, "*?[\\");
+    uint32_t lo = 0, hi = t->count, n = 0;
+
+    symtab_name_index(t);
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (strncmp(symbol_name(t, t->by_name[mid]), pattern, prefix) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (; lo < t->count; lo++) {
+        const char *name = symbol_name(t, t->by_name[lo]);
+        if (strncmp(name, pattern, prefix))
+            break;
+        if (pattern[prefix] ? !fnmatch(pattern, name, 0) : !name[prefix]) {
+            printf("%d %s %s 0x%08X\n", t->build, t->os ? "windows" : "linux", name, t->offsets[t->by_name[lo]]);
+            n++;
         }
     }
-    return NULL;
+    return n;
 }
 
-#define starts_with(str1, str2) (!strncmp(str1, str2, strlen(str2)))
+// Returns the index of the function containing offset, or ~0 if none.
+// The table is sorted by offset, so this is an upper-bound binary search:
+// find the last function starting at or before offset. The loop is kept
+// branchless (the compiler emits a cmov) since the probes are unpredictable.
+// A single check against the precomputed end then rejects offsets which fall
+// in a gap, before the first function or past the last one.
+uint32_t lookup(const struct symtab *t, uint32_t offset) {
+    if (!t->count || offset < t->offsets[0])
+        return ~0;
 
-char *detect_functions_file(int build, int os) {
+    const uint32_t *base = t->offsets;
+    uint32_t n = t->count;
+    while (n > 1) {
+        uint32_t half = n / 2;
+        base = (base[half] <= offset) ? base + half : base;
+        n -= half;
+    }
+
+    uint32_t i = base - t->offsets;
+    return offset < t->ends[i] ? i : ~0u;
+}
+// Buffered line reader. Input is read in large blocks and lines of any
+// length are returned in place, NUL terminated with the newline stripped.
+#define READ_BLOCK (1 << 20)
+struct reader {
+    FILE  *f;
+    char  *buf;
+    size_t size;
+    size_t pos;
+    size_t len;
+    int    eof;
+};
+
+char *read_line(struct reader *r, size_t *len, int *newline) {
+    for (;;) {
+        char *start = r->buf + r->pos;
+        char *nl = r->len > r->pos ? memchr(start, '\n', r->len - r->pos) : NULL;
+        if (nl) {
+            *nl = '\0';
+            *len = nl - start;
+            *newline = 1;
+            r->pos += *len + 1;
+            return start;
+        }
+        if (r->eof) {
+            if (r->pos == r->len)
+                return NULL;
+            start[r->len - r->pos] = '\0';
+            *len = r->len - r->pos;
+            *newline = 0;
+            r->pos = r->len;
+            return start;
+        }
+
+        memmove(r->buf, start, r->len - r->pos);
+        r->len -= r->pos;
+        r->pos = 0;
+        // Always leave room for the terminating NUL
+        if (r->size - r->len < READ_BLOCK / 2 + 1) {
+            r->size = r->size ? r->size * 2 : READ_BLOCK;
+            r->buf = xrealloc(r->buf, r->size);
+        }
+        size_t n = fread(r->buf + r->len, 1, r->size - r->len - 1, r->f);
+        if (n == 0) {
+            if (ferror(r->f))
+                die("Error reading input");
+            r->eof = 1;
+        }
+        r->len += n;
+    }
+}
+
+// Buffered output, flushed to the underlying stream in large writes
+struct writer {
+    FILE  *f;
+    size_t len;
+    char   buf[1 << 16];
+};
+
+void writer_flush(struct writer *w) {
+    if (w->len && fwrite(w->buf, 1, w->len, w->f) != w->len)
+        die("Error writing output");
+    w->len = 0;
+}
+
+void writer_put(struct writer *w, const char *s, size_t n) {
+    if (n > sizeof(w->buf) - w->len) {
+        writer_flush(w);
+        if (n > sizeof(w->buf)) {
+            if (fwrite(s, 1, n, w->f) != n)
+                die("Error writing output");
+            return;
+        }
+    }
+    memcpy(w->buf + w->len, s, n);
+    w->len += n;
+}
+
+#define writer_puts(w, s) writer_put(w, s, strlen(s))
+
+void writer_hex(struct writer *w, uint32_t v) {
+    char tmp[8];
+    int n = 0;
+    do {
+        tmp[7 - n++] = "0123456789abcdef"[v & 0xf];
+        v >>= 4;
+    } while (v);
+    writer_put(w, tmp + 8 - n, n);
+}
+
+// A decoded backtrace line. The trailing text of linux frames (after the
+// closing parenthesis) is kept so it can be reproduced in the output.
+enum frame_kind { FRAME_RAW, FRAME_LINUX };
+struct frame {
+    enum frame_kind kind;
+    uint32_t    offset;
+    uint32_t    idx;
+    const char *rest;
+    size_t      restlen;
+};
+
+#define LINUX_FRAME_PREFIX "./nwserver-linux(+0x"
+
+// Parses a backtrace line, either a raw hex offset (optionally 0x prefixed)
+// or a linux "./nwserver-linux(+0xOFFSET)..." frame. Returns 1 if the line
+// held an offset.
+int parse_frame(const char *line, size_t len, struct frame *frame) {
+    const char *p = line, *end = line + len;
+
+    while (p < end && isspace((unsigned char)*p))
+        p++;
+    if (parse_hex(&p, end, &frame->offset)) {
+        frame->kind = FRAME_RAW;
+    } else if (!args.raw && starts_with(line, LINUX_FRAME_PREFIX)) {
+        p = line + strlen(LINUX_FRAME_PREFIX);
+        while (p < end && isspace((unsigned char)*p))
+            p++;
+        if (!parse_hex(&p, end, &frame->offset))
+            return 0;
+        frame->kind    = FRAME_LINUX;
+        frame->rest    = (p < end && *p == ')') ? p + 1 : end;
+        frame->restlen = end - frame->rest;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+// Parses a backtrace line with parse_frame() and looks it up. Returns 1 if
+// the line held an offset which resolved to a known function.
+// These only read the symbol table, so may be used from several threads.
+int try_parse(const struct symtab *t, const char *line, size_t len, struct frame *frame) {
+    PROFILE_BEGIN(parse);
+    int parsed = parse_frame(line, len, frame);
+    PROFILE_END(PROF_PARSE, parse);
+    if (!parsed)
+        return 0;
+    PROFILE_BEGIN(lookup);
+    frame->idx = lookup(t, frame->offset);
+    PROFILE_END(PROF_LOOKUP, lookup);
+    return frame->idx != ~0u;
+}
+
+void write_frame(struct writer *w, const struct symtab *t, const struct frame *frame) {
+    if (frame->kind == FRAME_LINUX)
+        writer_puts(w, "./nwserver-linux(");
+    writer_puts(w, symbol_name(t, frame->idx));
+    writer_put(w, "+0x", 3);
+    writer_hex(w, frame->offset - t->offsets[frame->idx]);
+    if (frame->kind == FRAME_LINUX) {
+        writer_put(w, ")", 1);
+        writer_put(w, frame->rest, frame->restlen);
+    }
+    writer_put(w, "\n", 1);
+}
+
+// Given the path of an existing .hpp in out, replaces it with its compiled
+// .nwsym sibling if one exists and is at least as new as the header.
+static int prefer_index(char *out, size_t size) {
+    struct stat hpp, idx;
+    char path[1024];
+    size_t len = strlen(out);
+    if (len < 4 || len - 4 + sizeof(".nwsym") > sizeof(path) || len - 4 + sizeof(".nwsym") > size)
+        return 0;
+    memcpy(path, out, len - 4);
+    strcpy(path + len - 4, ".nwsym");
+    if (stat(path, &idx) || (!stat(out, &hpp) && idx.st_mtime < hpp.st_mtime))
+        return 0;
+    strcpy(out, path);
+    return 1;
+}
+
+// Expands a leading ~ in path to $HOME. Returns 0 if it can't.
+static int expand_home(const char *path, char *out, size_t size) {
+    const char *home = getenv("HOME");
+    if (path[0] != '~')
+        return snprintf(out, size, "%s", path) < (int)size;
+    return home && snprintf(out, size, "%s%s", home, path + 1) < (int)size;
+}
+
+// Returns a static buffer, or NULL after printing why nothing was found.
+// Only called from detect_functions_file().
+static char *probe_functions_file(int build, int os) {
     static char out[1024];
     static const char *paths[] = {
         "extra/offsets",
@@ -152,8 +931,12 @@ char *detect_functions_file(int build, int os) {
         FILE *f = fopen(out, "r");
         if (f) {
             fclose(f);
+            prefer_index(out, sizeof(out));
             return out;
         }
+        sprintf(out, "%s/%s-%4d.nwsym", paths[i], filenames[os], build);
+        if (index_build(out) == build)
+            return out;
     }
     // Try to detect nwnx and use the current one..
     static const char *nwnxpaths[] = {
@@ -178,8 +961,20 @@ char *detect_functions_file(int build, int os) {
         "."
     };
     for (uint32_t i = 0; i < (sizeof(nwnxpaths)/sizeof(nwnxpaths[0])); i++) {
-        sprintf(out, "%s/NWNXLib/API/%s.hpp", nwnxpaths[i], filenames[os]);
+        char dir[768];
+        if (!expand_home(nwnxpaths[i], dir, sizeof(dir)))
+            continue;
+        sprintf(out, "%s/NWNXLib/API/%s.hpp", dir, filenames[os]);
         FILE *f = fopen(out, "r");
+        if (f && prefer_index(out, sizeof(out))) {
+            fclose(f);
+            int nwnxbuild = index_build(out);
+            if (nwnxbuild != build) {
+                fprintf(stderr, "Autodetect found NWNX at build %d, but need build %d\n", nwnxbuild, build);
+                return NULL;
+            }
+            return out;
+        }
         if (f) {
             char buf[1024];
             int nwnxbuild = 0;
@@ -188,52 +983,1254 @@ char *detect_functions_file(int build, int os) {
                     break;
             }
             fclose(f);
-            if (nwnxbuild != build)
-                die("Autodetect found NWNX at build %d, but need build %d", nwnxbuild, build);
-
+            if (nwnxbuild != build) {
+                fprintf(stderr, "Autodetect found NWNX at build %d, but need build %d\n", nwnxbuild, build);
+                return NULL;
+            }
             return out;
         }
     }
-    die("Autodetect of functions file failed");
+    fprintf(stderr, "Autodetect of functions file for build %d (%s) failed\n", build, os ? "windows" : "linux");
+    return NULL;
 }
 
-int main(int argc, char *argv[])
-{
-    parse_cmdline(argc, argv);
-    if (!args.autodetect)
-        load_functions(args.funcfile);
+// Autodetect results are remembered across runs in a small text file of
+// "BUILD OS MTIME PATH" lines, under $XDG_CACHE_HOME or ~/.cache. An entry
+// is used as long as the file it names still has the same mtime.
+static int autodetect_cache_file(char *out, size_t size) {
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    if (xdg && *xdg) {
+        mkdir(xdg, 0755);
+        return snprintf(out, size, "%s/nwserver-dump-decode.paths", xdg) < (int)size;
+    }
+    if (!expand_home("~/.cache", out, size))
+        return 0;
+    mkdir(out, 0755);
+    return expand_home("~/.cache/nwserver-dump-decode.paths", out, size);
+}
+
+// Given a .nwsym path in out, replaces it with the .hpp next to it if that
+// exists. Returns 1 if it did.
+static int index_source(char *out, size_t size) {
+    struct stat st;
+    size_t len = strlen(out);
+    if (!ends_with(out, ".nwsym") || len - 6 + sizeof(".hpp") > size)
+        return 0;
+    char path[4096];
+    snprintf(path, sizeof(path), "%.*s.hpp", (int)(len - 6), out);
+    if (stat(path, &st))
+        return 0;
+    strcpy(out, path);
+    return 1;
+}
+
+static int autodetect_cache_lookup(int build, int os, char *out, size_t size) {
+    char cachefile[1024], line[1200];
+    FILE *f;
+    if (!autodetect_cache_file(cachefile, sizeof(cachefile)) || !(f = fopen(cachefile, "r")))
+        return 0;
+
+    int found = 0;
+    while (!found && fgets(line, sizeof(line), f)) {
+        int b, o, n;
+        long long mtime;
+        struct stat st;
+        if (sscanf(line, "%d %d %lld %n", &b, &o, &mtime, &n) != 3 || b != build || o != os)
+            continue;
+        line[strcspn(line, "\n")] = '\0';
+        if (strlen(line + n) >= size || stat(line + n, &st) || (long long)st.st_mtime != mtime)
+            continue;
+        strcpy(out, line + n);
+        found = 1;
+    }
+    fclose(f);
+    if (found) {
+        // Entries written before .hpp paths were always stored may name the
+        // index itself; check it against its .hpp like a fresh detect would
+        index_source(out, size);
+        if (ends_with(out, ".hpp"))
+            prefer_index(out, size);
+    }
+    return found;
+}
+
+// Rewrites the cache with path as the entry for (build, os)
+// Stores the .hpp a detected .nwsym was compiled from when there is one, so
+// that every hit goes through prefer_index() and a stale index is never used.
+static void autodetect_cache_store(int build, int os, const char *path) {
+    char cachefile[1024], tmpfile[1100], abspath[4096], line[1200], source[4096];
+    struct stat st;
+    snprintf(source, sizeof(source), "%s", path);
+    index_source(source, sizeof(source));
+    if (!autodetect_cache_file(cachefile, sizeof(cachefile)) || !realpath(source, abspath) || stat(abspath, &st))
+        return;
+    snprintf(tmpfile, sizeof(tmpfile), "%s.%d", cachefile, (int)getpid());
+
+    FILE *out = fopen(tmpfile, "w"), *in = fopen(cachefile, "r");
+    if (!out) {
+        if (in)
+            fclose(in);
+        return;
+    }
+    while (in && fgets(line, sizeof(line), in)) {
+        int b, o;
+        if (sscanf(line, "%d %d", &b, &o) == 2 && !(b == build && o == os))
+            fputs(line, out);
+    }
+    fprintf(out, "%d %d %lld %s\n", build, os, (long long)st.st_mtime, abspath);
+    if (in)
+        fclose(in);
+    if (fclose(out) || rename(tmpfile, cachefile))
+        unlink(tmpfile);
+}
+
+// Finds the functions file for a build, from the on-disk cache if possible.
+// Returns a static buffer, or NULL if there is none; only called from get_symtab() with the cache
+// locked, which also keeps each (build, os) from being detected twice.
+char *detect_functions_file(int build, int os) {
+    static char out[4096];
+    double start = now_ms();
+    PROFILE_BEGIN(detect);
+    if (!args.no_cache && autodetect_cache_lookup(build, os, out, sizeof(out))) {
+        PROFILE_END(PROF_DETECT, detect);
+        if (args.verbose)
+            fprintf(stderr, "Autodetect cache hit for build %d (%s): '%s' in %.3f ms\n",
+                    build, os ? "windows" : "linux", out, now_ms() - start);
+        return out;
+    }
+
+    const char *found = probe_functions_file(build, os);
+    if (!found) {
+        PROFILE_END(PROF_DETECT, detect);
+        return NULL;
+    }
+    snprintf(out, sizeof(out), "%s", found);
+    if (!args.no_cache)
+        autodetect_cache_store(build, os, out);
+    PROFILE_END(PROF_DETECT, detect);
+    if (args.verbose)
+        fprintf(stderr, "Autodetected '%s' for build %d (%s) in %.3f ms\n",
+                out, build, os ? "windows" : "linux", now_ms() - start);
+    return out;
+}
+
+// Symbol tables loaded by autodetect, keyed by (build, os) so that every
+// functions file is only loaded once no matter how many dumps reference it.
+struct symcache {
+    int build;
+    int os;
+    struct symtab *symtab;
+    struct symcache *next;
+} *symcache;
+pthread_mutex_t symcache_lock = PTHREAD_MUTEX_INITIALIZER;
+// Set by --serve once all tables are loaded in the parent. Other builds are
+// then unknown (NULL), rather than autodetected again in every request's child.
+int symcache_frozen;
+
+// Returns the table for a build, loading it on first use, or NULL if none
+// can be found. Builds that were not found stay NULL, so each is only
+// reported once.
+struct symtab *get_symtab(int build, int os) {
+    pthread_mutex_lock(&symcache_lock);
+    for (struct symcache *c = symcache; c; c = c->next) {
+        if (c->build == build && c->os == os) {
+            pthread_mutex_unlock(&symcache_lock);
+            return c->symtab;
+        }
+    }
+    if (symcache_frozen) {
+        pthread_mutex_unlock(&symcache_lock);
+        return NULL;
+    }
+
+    struct symcache *c = malloc(sizeof(*c));
+    if (!c)
+        die("Out of memory");
+    c->build  = build;
+    c->os     = os;
+    const char *path = detect_functions_file(build, os);
+    c->symtab = path ? load_functions(path) : NULL;
+    c->next   = symcache;
+    symcache  = c;
+    pthread_mutex_unlock(&symcache_lock);
+    return c->symtab;
+}
+
+// Loads every Functions{Linux,Windows}-BUILD.hpp (or its .nwsym) in dir
+// into the symbol cache, so that all builds are available at once and
+// autodetect never has to look for them. Returns the number of tables.
+int load_all_builds(const char *dir) {
+    DIR *d = opendir(dir);
+    if (!d)
+        die("Unable to open offsets directory '%s'", dir);
+
+    struct dirent *e;
+    int n = 0;
+    while ((e = readdir(d))) {
+        char osname[16], ext[8], path[1024];
+        int build, os;
+        if (sscanf(e->d_name, "Functions%15[A-Za-z]-%d.%7s", osname, &build, ext) != 3)
+            continue;
+        if (!strcmp(osname, "Linux"))
+            os = 0;
+        else if (!strcmp(osname, "Windows"))
+            os = 1;
+        else
+            continue;
+        if (snprintf(path, sizeof(path), "%s/%s", dir, e->d_name) >= (int)sizeof(path))
+            continue;
+        if (!strcmp(ext, "hpp")) {
+            prefer_index(path, sizeof(path));
+        } else if (strcmp(ext, "nwsym")) {
+            continue;
+        } else {
+            // Picked up through its .hpp, if there is one
+            struct stat st;
+            snprintf(path, sizeof(path), "%s/Functions%s-%d.hpp", dir, osname, build);
+            if (!stat(path, &st))
+                continue;
+            snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        }
 
-    FILE *in = args.dumpfile ? fopen(args.dumpfile, "r") : stdin;
-    if (!in)
-        die("Unable to open input file '%s'", args.dumpfile);
+        pthread_mutex_lock(&symcache_lock);
+        struct symcache *c;
+        for (c = symcache; c && !(c->build == build && c->os == os); c = c->next);
+        if (!c) {
+            if (!(c = malloc(sizeof(*c))))
+                die("Out of memory");
+            c->build  = build;
+            c->os     = os;
+            c->symtab = load_functions(path);
+            if (c->symtab) {
+                c->symtab->os = os;
+                if (!c->symtab->build)
+                    c->symtab->build = build;
+                n++;
+            }
+            c->next   = symcache;
+            symcache  = c;
+        }
+        pthread_mutex_unlock(&symcache_lock);
+    }
+    closedir(d);
+    return n;
+}
 
-    char buf[1024];
+static int symtabcmp(const void *a, const void *b) {
+    const struct symtab *x = *(struct symtab *const *)a, *y = *(struct symtab *const *)b;
+    return x->os != y->os ? x->os - y->os : x->build - y->build;
+}
+
+// Returns all cached symbol tables sorted by OS and build, in *n
+struct symtab **all_symtabs(int *n) {
+    struct symtab **tables = NULL;
+    *n = 0;
+    for (struct symcache *c = symcache; c; c = c->next) {
+        if (!c->symtab)
+            continue;
+        tables = xrealloc(tables, (*n + 1) * sizeof(*tables));
+        tables[(*n)++] = c->symtab;
+    }
+    if (*n)
+        qsort(tables, *n, sizeof(*tables), symtabcmp);
+    return tables;
+}
+
+// Hit counts for --aggregate, in open addressing hash maps keyed by the
+// symbol table and function index from lookup() (plus the offset into the
+// function for the per-offset counts)
+struct histentry {
+    const struct symtab *symtab;  // NULL for an empty slot
+    uint32_t idx;
+    uint32_t delta;
+    uint64_t count;
+};
+
+struct histmap {
+    struct histentry *entries;
+    uint32_t size;                // always a power of two
+    uint32_t used;
+};
+
+// Folded stacks for --folded, keyed by the folded string itself so that
+// stacks decoded against different symbol tables still merge
+struct stackentry {
+    char    *stack;               // NULL for an empty slot
+    uint64_t hash;
+    uint64_t count;
+};
+
+struct stackmap {
+    struct stackentry *entries;
+    uint32_t size;                // always a power of two
+    uint32_t used;
+};
+
+struct aggregate {
+    struct histmap functions;
+    struct histmap offsets;
+    struct stackmap stacks;
+    uint64_t frames;
+};
+
+// The frames of the backtrace currently being read, innermost first
+struct stack {
+    const struct symtab **symtabs;
+    uint32_t *idx;
+    uint32_t  count;
+    uint32_t  capacity;
+};
+
+static uint32_t hist_hash(const struct symtab *t, uint32_t idx, uint32_t delta) {
+    uint64_t h = ((uintptr_t)t >> 4) * 0x9E3779B97F4A7C15ull;
+    h ^= (idx + 0x7F4A7C15ull) * 0xBF58476D1CE4E5B9ull;
+    h ^= (delta + 0x1CE4E5B9ull) * 0x94D049BB133111EBull;
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+void hist_add(struct histmap *m, const struct symtab *t, uint32_t idx, uint32_t delta, uint64_t count) {
+    if ((m->used + 1) * 4 > m->size * 3) {
+        struct histmap old = *m;
+        m->size = old.size ? old.size * 2 : 1024;
+        m->used = 0;
+        m->entries = calloc(m->size, sizeof(*m->entries));
+        if (!m->entries)
+            die("Out of memory");
+        for (uint32_t i = 0; i < old.size; i++) {
+            if (old.entries[i].symtab)
+                hist_add(m, old.entries[i].symtab, old.entries[i].idx, old.entries[i].delta, old.entries[i].count);
+        }
+        free(old.entries);
+    }
+
+    uint32_t i = hist_hash(t, idx, delta) & (m->size - 1);
+    while (m->entries[i].symtab) {
+        struct histentry *e = &m->entries[i];
+        if (e->symtab == t && e->idx == idx && e->delta == delta) {
+            e->count += count;
+            return;
+        }
+        i = (i + 1) & (m->size - 1);
+    }
+    m->entries[i] = (struct histentry){ t, idx, delta, count };
+    m->used++;
+}
+
+void aggregate_frame(struct aggregate *agg, const struct symtab *t, const struct frame *frame) {
+    hist_add(&agg->functions, t, frame->idx, 0, 1);
+    hist_add(&agg->offsets, t, frame->idx, frame->offset - t->offsets[frame->idx], 1);
+    agg->frames++;
+}
+
+static uint64_t stack_hash(const char *s, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (uint8_t)s[i]) * 0x100000001b3ull;
+    return h;
+}
+
+// Adds count to the given stack; takes ownership of (or frees) str
+void stackmap_add(struct stackmap *m, char *str, uint64_t hash, uint64_t count) {
+    if ((m->used + 1) * 4 > m->size * 3) {
+        struct stackmap old = *m;
+        m->size = old.size ? old.size * 2 : 1024;
+        m->used = 0;
+        m->entries = calloc(m->size, sizeof(*m->entries));
+        if (!m->entries)
+            die("Out of memory");
+        for (uint32_t i = 0; i < old.size; i++) {
+            if (old.entries[i].stack)
+                stackmap_add(m, old.entries[i].stack, old.entries[i].hash, old.entries[i].count);
+        }
+        free(old.entries);
+    }
+
+    uint32_t i = (uint32_t)(hash ^ (hash >> 32)) & (m->size - 1);
+    while (m->entries[i].stack) {
+        struct stackentry *e = &m->entries[i];
+        if (e->hash == hash && !strcmp(e->stack, str)) {
+            e->count += count;
+            free(str);
+            return;
+        }
+        i = (i + 1) & (m->size - 1);
+    }
+    m->entries[i] = (struct stackentry){ str, hash, count };
+    m->used++;
+}
+
+void stack_push(struct stack *stack, const struct symtab *t, uint32_t idx) {
+    if (stack->count == stack->capacity) {
+        stack->capacity = stack->capacity ? stack->capacity * 2 : 64;
+        stack->symtabs = xrealloc(stack->symtabs, stack->capacity * sizeof(*stack->symtabs));
+        stack->idx     = xrealloc(stack->idx, stack->capacity * sizeof(*stack->idx));
+    }
+    stack->symtabs[stack->count] = t;
+    stack->idx[stack->count]     = idx;
+    stack->count++;
+}
+
+// Folds the current backtrace into 'outermost;...;innermost' and counts it
+void stack_fold(struct aggregate *agg, struct stack *stack) {
+    if (!stack->count)
+        return;
+
+    size_t len = 0;
+    for (uint32_t i = 0; i < stack->count; i++)
+        len += strlen(symbol_name(stack->symtabs[i], stack->idx[i])) + 1;
+
+    char *str = xrealloc(NULL, len), *p = str;
+    for (uint32_t i = stack->count; i-- > 0; ) {
+        const char *name = symbol_name(stack->symtabs[i], stack->idx[i]);
+        size_t n = strlen(name);
+        memcpy(p, name, n);
+        p += n;
+        *p++ = i ? ';' : '\0';
+    }
+
+    stackmap_add(&agg->stacks, str, stack_hash(str, len - 1), 1);
+    agg->frames += stack->count;
+    stack->count = 0;
+}
+
+void aggregate_merge(struct aggregate *dst, struct aggregate *src) {
+    struct histmap *maps[][2] = { { &dst->functions, &src->functions }, { &dst->offsets, &src->offsets } };
+    for (int m = 0; m < 2; m++) {
+        for (uint32_t i = 0; i < maps[m][1]->size; i++) {
+            struct histentry *e = &maps[m][1]->entries[i];
+            if (e->symtab)
+                hist_add(maps[m][0], e->symtab, e->idx, e->delta, e->count);
+        }
+        free(maps[m][1]->entries);
+    }
+    for (uint32_t i = 0; i < src->stacks.size; i++) {
+        struct stackentry *e = &src->stacks.entries[i];
+        if (e->stack)
+            stackmap_add(&dst->stacks, e->stack, e->hash, e->count);
+    }
+    free(src->stacks.entries);
+    dst->frames += src->frames;
+    memset(src, 0, sizeof(*src));
+}
+
+static int histcmp(const void *a, const void *b) {
+    const struct histentry *e1 = a, *e2 = b;
+    if (e1->count != e2->count)
+        return e1->count < e2->count ? 1 : -1;
+    int c = strcmp(symbol_name(e1->symtab, e1->idx), symbol_name(e2->symtab, e2->idx));
+    if (c)
+        return c;
+    if (e1->symtab->build != e2->symtab->build)
+        return e1->symtab->build - e2->symtab->build;
+    if (e1->symtab->os != e2->symtab->os)
+        return e1->symtab->os - e2->symtab->os;
+    return (int64_t)e1->delta - (int64_t)e2->delta;
+}
+
+void print_histmap(const struct histmap *m, const char *title, uint64_t total, int with_delta) {
+    struct histentry *sorted = malloc((m->used + 1) * sizeof(*sorted));
+    if (!sorted)
+        die("Out of memory");
+
+    // Only show the build when counts come from more than one symbol table
+    uint32_t n = 0;
+    int multi = 0;
+    for (uint32_t i = 0; i < m->size; i++) {
+        if (m->entries[i].symtab) {
+            sorted[n] = m->entries[i];
+            multi |= sorted[n].symtab != sorted[0].symtab;
+            n++;
+        }
+    }
+    qsort(sorted, n, sizeof(*sorted), histcmp);
+
+    uint32_t shown = (args.top && (uint32_t)args.top < n) ? (uint32_t)args.top : n;
+    printf("Top %u of %u %s by hits (%llu frames):\n", shown, n, title, (unsigned long long)total);
+    printf("%10s %7s  %s%s\n", "count", "%", multi ? "build         " : "", "function");
+    for (uint32_t i = 0; i < shown; i++) {
+        const struct histentry *e = &sorted[i];
+        printf("%10llu %6.2f%%  ", (unsigned long long)e->count, total ? 100.0 * e->count / total : 0.0);
+        if (multi)
+            printf("%-5d %-7s ", e->symtab->build, e->symtab->os ? "windows" : "linux");
+        if (with_delta)
+            printf("%s+0x%x\n", symbol_name(e->symtab, e->idx), e->delta);
+        else
+            printf("%s\n", symbol_name(e->symtab, e->idx));
+    }
+    free(sorted);
+}
+
+void print_aggregate(const struct aggregate *agg) {
+    print_histmap(&agg->functions, "functions", agg->frames, 0);
+    printf("\n");
+    print_histmap(&agg->offsets, "function offsets", agg->frames, 1);
+}
+
+static int stackcmp(const void *a, const void *b) {
+    const struct stackentry *e1 = a, *e2 = b;
+    return strcmp(e1->stack, e2->stack);
+}
+
+void print_folded(const struct aggregate *agg) {
+    const struct stackmap *m = &agg->stacks;
+    struct stackentry *sorted = malloc((m->used + 1) * sizeof(*sorted));
+    if (!sorted)
+        die("Out of memory");
+
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < m->size; i++) {
+        if (m->entries[i].stack)
+            sorted[n++] = m->entries[i];
+    }
+    qsort(sorted, n, sizeof(*sorted), stackcmp);
+
+    for (uint32_t i = 0; i < n; i++)
+        printf("%s %llu\n", sorted[i].stack, (unsigned long long)sorted[i].count);
+    free(sorted);
+}
+
+// Decodes in to out, or when agg is given, counts the frames into it instead.
+// Returns 1 if autodetect found no functions file for the log, whose frames
+// are then left undecoded.
+int decode_file(FILE *in, FILE *out, struct symtab *symtab, struct aggregate *agg) {
+    struct reader r = { .f = in };
+    struct writer *w = malloc(sizeof(*w));
+    if (!w)
+        die("Out of memory");
+    w->f   = agg ? NULL : out;
+    w->len = 0;
+
+    struct frame frame;
+    struct stack stack = {0};
+    char  *line;
+    size_t len;
+    int    newline;
     int skip = 0;
     int windows = 1;
-    int build;
+    int build = 0;
+    int missing = 0;
 
-    while (fgets(buf, 1024, in)) {
-        if (starts_with(buf, "=== ")) {
-            skip = !starts_with(buf, "=== Backtrace");
+    for (;;) {
+        PROFILE_BEGIN(read);
+        line = read_line(&r, &len, &newline);
+        PROFILE_END(PROF_READ, read);
+        if (!line)
+            break;
+        PROFILE_LINE();
+        if (!args.raw && line[0] == '=' && starts_with(line, "=== ")) {
+            skip = !starts_with(line, "=== Backtrace");
+            if (args.folded)
+                stack_fold(agg, &stack);
         }
+        if (args.folded && !len)
+            stack_fold(agg, &stack);
 
         if (args.autodetect) {
-            sscanf(buf, "g_sBuildNumber = %d", &build);
-            if (starts_with(buf, "&GenericCrashHandler")) {
-                if (starts_with(buf, "&GenericCrashHandler = 0x"))
+            sscanf(line, "g_sBuildNumber = %d", &build);
+            if (starts_with(line, "&GenericCrashHandler")) {
+                if (starts_with(line, "&GenericCrashHandler = 0x"))
                     windows = 0;
-                load_functions(detect_functions_file(build, windows));
+                missing |= !(symtab = get_symtab(build, windows));
+            }
+        }
+
+        int decoded = symtab && try_parse(symtab, line, len, &frame) && !skip;
+        PROFILE_BEGIN(output);
+        if (decoded) {
+            if (args.folded)
+                stack_push(&stack, symtab, frame.idx);
+            else if (agg)
+                aggregate_frame(agg, symtab, &frame);
+            else
+                write_frame(w, symtab, &frame);
+        } else if (args.repeat && !agg) {
+            writer_put(w, line, len);
+            if (newline)
+                writer_put(w, "\n", 1);
+        }
+        PROFILE_END(PROF_OUTPUT, output);
+    }
+
+    if (args.folded)
+        stack_fold(agg, &stack);
+    free(stack.symtabs);
+    free(stack.idx);
+
+    PROFILE_BEGIN(output);
+    writer_flush(w);
+    PROFILE_END(PROF_OUTPUT, output);
+    free(w);
+    free(r.buf);
+    profile_flush();
+    return missing;
+}
+
+// Decodes one dump file, either to out or, with --suffix, to its own file.
+// Returns 1 after reporting it on stderr if the file could not be opened or
+// decoded, so that a batch carries on with the other files.
+int decode_dumpfile(const char *dumpfile, FILE *out, struct symtab *symtab, struct aggregate *agg) {
+    FILE *in = fopen(dumpfile, "r");
+    if (!in) {
+        fprintf(stderr, "Unable to open input file '%s'\n", dumpfile);
+        return 1;
+    }
+
+    if (args.suffix) {
+        char outfile[1024];
+        if (snprintf(outfile, sizeof(outfile), "%s%s", dumpfile, args.suffix) >= (int)sizeof(outfile))
+            die("Output file name too long for '%s'", dumpfile);
+        out = fopen(outfile, "w");
+        if (!out)
+            die("Unable to create output file '%s'", outfile);
+    }
+
+    int failed = decode_file(in, out, symtab, agg);
+    if (failed)
+        fprintf(stderr, "No functions file for '%s', left undecoded\n", dumpfile);
+
+    fclose(in);
+    if (args.suffix && fclose(out))
+        die("Unable to write output for '%s'", dumpfile);
+    return failed;
+}
+
+// With --jobs, dump files are handed out to a pool of worker threads. When
+// writing to stdout, each job's output is buffered in memory and printed by
+// the main thread in the original file order as jobs complete.
+struct job {
+    const char *dumpfile;
+    char       *output;
+    size_t      size;
+    struct aggregate agg;
+    int         failed;
+    int         done;
+};
+
+struct pool {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    struct job     *jobs;
+    int             njobs;
+    int             next;
+    struct symtab  *symtab;
+} pool = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+void *worker(void *arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&pool.lock);
+        int i = pool.next++;
+        pthread_mutex_unlock(&pool.lock);
+        if (i >= pool.njobs)
+            return NULL;
+
+        struct job *job = &pool.jobs[i];
+        FILE *out = NULL;
+        if (!args.suffix && !args.aggregate && !args.folded && !(out = open_memstream(&job->output, &job->size)))
+            die("Out of memory");
+
+        job->failed = decode_dumpfile(job->dumpfile, out, pool.symtab, (args.aggregate || args.folded) ? &job->agg : NULL);
+
+        if (out && fclose(out))
+            die("Out of memory");
+
+        pthread_mutex_lock(&pool.lock);
+        job->done = 1;
+        pthread_cond_broadcast(&pool.cond);
+        pthread_mutex_unlock(&pool.lock);
+    }
+}
+
+void print_dumpfile_header(int i) {
+    if (!args.suffix && !args.aggregate && !args.folded && args.ndumpfiles > 1)
+        printf("%s==> %s <==\n", i ? "\n" : "", args.dumpfiles[i]);
+}
+
+// Returns the number of dump files that failed
+int decode_parallel(struct symtab *symtab, struct aggregate *agg) {
+    int failed = 0;
+    int nthreads = args.jobs < args.ndumpfiles ? args.jobs : args.ndumpfiles;
+    pthread_t *threads = malloc(nthreads * sizeof(*threads));
+    pool.jobs = calloc(args.ndumpfiles, sizeof(*pool.jobs));
+    if (!threads || !pool.jobs)
+        die("Out of memory");
+
+    pool.njobs  = args.ndumpfiles;
+    pool.symtab = symtab;
+    for (int i = 0; i < pool.njobs; i++)
+        pool.jobs[i].dumpfile = args.dumpfiles[i];
+
+    for (int i = 0; i < nthreads; i++) {
+        if (pthread_create(&threads[i], NULL, worker, NULL))
+            die("Unable to create worker thread");
+    }
+
+    for (int i = 0; i < pool.njobs; i++) {
+        struct job *job = &pool.jobs[i];
+        pthread_mutex_lock(&pool.lock);
+        while (!job->done)
+            pthread_cond_wait(&pool.cond, &pool.lock);
+        pthread_mutex_unlock(&pool.lock);
+
+        print_dumpfile_header(i);
+        if (job->size)
+            fwrite(job->output, 1, job->size, stdout);
+        free(job->output);
+        failed += job->failed;
+        if (agg)
+            aggregate_merge(agg, &job->agg);
+    }
+
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    free(pool.jobs);
+    return failed;
+}
+
+// Decodes every offset in the input against all tables, printing one
+// 'OFFSET BUILD OS FUNCTION+DELTA' line per table the offset falls in, or
+// 'OFFSET unknown' if none. Linux frames are only looked up in the linux
+// tables. Other lines, and crash log sections other than the backtrace,
+// are skipped, or copied with -r.
+void decode_all_builds(FILE *in, struct symtab **tables, int ntables) {
+    struct reader r = { .f = in };
+    struct writer *w = malloc(sizeof(*w));
+    if (!w)
+        die("Out of memory");
+    w->f   = stdout;
+    w->len = 0;
+
+    struct frame frame;
+    char  *line;
+    size_t len;
+    int    newline;
+    int skip = 0;
+    while ((line = read_line(&r, &len, &newline))) {
+        if (line[0] == '=' && starts_with(line, "=== "))
+            skip = !starts_with(line, "=== Backtrace");
+
+        int found = 0, parsed = !skip && parse_frame(line, len, &frame);
+        for (int i = 0; i < ntables && parsed; i++) {
+            if (frame.kind == FRAME_LINUX && tables[i]->os)
+                continue;
+            if ((frame.idx = lookup(tables[i], frame.offset)) == ~0u)
+                continue;
+            char build[16];
+            writer_put(w, "0x", 2);
+            writer_hex(w, frame.offset);
+            writer_put(w, build, snprintf(build, sizeof(build), " %d ", tables[i]->build));
+            writer_puts(w, tables[i]->os ? "windows " : "linux ");
+            writer_puts(w, symbol_name(tables[i], frame.idx));
+            writer_put(w, "+0x", 3);
+            writer_hex(w, frame.offset - tables[i]->offsets[frame.idx]);
+            writer_put(w, "\n", 1);
+            found = 1;
+        }
+        if (!found && parsed) {
+            writer_put(w, "0x", 2);
+            writer_hex(w, frame.offset);
+            writer_puts(w, " unknown\n");
+        } else if (!found && args.repeat) {
+            writer_put(w, line, len);
+            writer_put(w, "\n", 1);
+        }
+    }
+    writer_flush(w);
+    free(w);
+    free(r.buf);
+}
+
+// Prints which functions were added, removed, moved or resized from table a
+// to table b, matching them up by name
+void diff_symtabs(struct symtab *a, struct symtab *b) {
+    uint32_t i = 0, j = 0, moved = 0, resized = 0, added = 0, removed = 0, same = 0;
+    symtab_name_index(a);
+    symtab_name_index(b);
+    printf("--- %d %s\n+++ %d %s\n", a->build, a->os ? "windows" : "linux", b->build, b->os ? "windows" : "linux");
+    while (i < a->count || j < b->count) {
+        uint32_t x = i < a->count ? a->by_name[i] : 0, y = j < b->count ? b->by_name[j] : 0;
+        int c = i == a->count ? 1 : j == b->count ? -1 : strcmp(symbol_name(a, x), symbol_name(b, y));
+        if (c < 0) {
+            printf("- %s 0x%08X\n", symbol_name(a, x), a->offsets[x]);
+            removed++, i++;
+        } else if (c > 0) {
+            printf("+ %s 0x%08X\n", symbol_name(b, y), b->offsets[y]);
+            added++, j++;
+        } else {
+            int move = a->offsets[x] != b->offsets[y];
+            // The last function's size is unknown unless --max-gap caps it
+            int known = args.max_gap || (x + 1 < a->count && y + 1 < b->count);
+            int resize = known && symbol_size(a, x) != symbol_size(b, y);
+            if (move || resize) {
+                printf("~ %s 0x%08X -> 0x%08X", symbol_name(a, x), a->offsets[x], b->offsets[y]);
+                if (resize)
+                    printf(", size 0x%x -> 0x%x", symbol_size(a, x), symbol_size(b, y));
+                printf("\n");
+            } else {
+                same++;
             }
+            moved += move;
+            resized += resize;
+            i++, j++;
         }
+    }
+    printf("%u moved, %u resized, %u added, %u removed, %u unchanged\n", moved, resized, added, removed, same);
+}
 
-        char *parse = try_parse(buf);
-        if (parse && !skip) {
-            printf("%s\n", parse);
-        } else if (args.repeat) {
-            printf("%s", buf);
+// --bench: load, lookup and decode timings for one functions file, with
+// lookup() checked against a plain linear search
+#define BENCH_RUNS    5
+#define BENCH_LOOKUPS (1 << 22)
+#define BENCH_FRAMES  (1 << 20)
+
+static uint64_t bench_random(uint64_t *x) {
+    *x ^= *x << 13;
+    *x ^= *x >> 7;
+    *x ^= *x << 17;
+    return *x;
+}
+
+static int u32cmp(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Runs lookup() on every offset, returning the lookups per second
+static double bench_lookups(const struct symtab *t, const uint32_t *offsets, size_t n) {
+    volatile uint32_t sink = 0;
+    double start = now_ms();
+    for (size_t i = 0; i < n; i++)
+        sink += lookup(t, offsets[i]);
+    (void)sink;
+    return n / ((now_ms() - start) / 1000.0);
+}
+
+// Checks lookup() on the sorted offsets against a linear walk over the
+// table. Returns the number of mismatches.
+static size_t bench_check(const struct symtab *t, const uint32_t *sorted, size_t n) {
+    size_t bad = 0;
+    uint32_t i = 0;
+    for (size_t k = 0; k < n; k++) {
+        while (i + 1 < t->count && t->offsets[i+1] <= sorted[k])
+            i++;
+        uint32_t expected = (t->count && t->offsets[i] <= sorted[k] && sorted[k] < t->ends[i]) ? i : ~0u;
+        uint32_t got = lookup(t, sorted[k]);
+        if (got != expected && (got == ~0u || expected == ~0u || t->offsets[got] != t->offsets[expected])) {
+            if (bad++ < 10)
+                fprintf(stderr, "Mismatch at 0x%x: lookup() gave %d, linear search %d\n", sorted[k], (int)got, (int)expected);
         }
     }
+    return bad;
+}
+
+// Decodes a synthetic log of frames in memory, printing the throughput
+static void bench_decode(struct symtab *t, const char *format, int raw, uint64_t *seed) {
+    char  *log;
+    size_t size;
+    FILE *f = open_memstream(&log, &size);
+    FILE *null = fopen("/dev/null", "w");
+    if (!f || !null)
+        die("Unable to create the benchmark log");
+
+    uint32_t span = t->offsets[t->count - 1] - t->offsets[0] + 1;
+    if (!raw)
+        fprintf(f, "=== Backtrace ===\n");
+    for (int i = 0; i < BENCH_FRAMES; i++) {
+        uint32_t offset = t->offsets[0] + bench_random(seed) % span;
+        if (raw)
+            fprintf(f, "%x\n", offset);
+        else
+            fprintf(f, LINUX_FRAME_PREFIX "%x) [0x%llx]\n", offset, (unsigned long long)(0x400000 + offset));
+        if (!raw && i % 32 == 31)
+            fprintf(f, "\n=== Backtrace ===\n");
+    }
+    if (fclose(f))
+        die("Out of memory");
 
-    return 0;
+    if (!(f = fmemopen(log, size, "r")))
+        die("Unable to open the benchmark log");
+    args.raw = raw;
+    double start = now_ms();
+    decode_file(f, null, t, NULL);
+    double secs = (now_ms() - start) / 1000.0;
+    args.raw = 0;
+    fclose(f);
+    fclose(null);
+    free(log);
+
+    printf("  decode %-7s %.1f MB in %.3f s, %.1f MB/s\n", format, size / 1e6, secs, size / 1e6 / secs);
+}
+
+// Returns the number of lookup mismatches found
+static size_t bench(const char *funcfile) {
+    double min = 0, total = 0;
+    struct symtab *t = NULL;
+    for (int i = 0; i < BENCH_RUNS; i++) {
+        if (t)
+            free_symtab(t);
+        double start = now_ms();
+        if (!(t = load_functions(funcfile)))
+            exit(~0);
+        double ms = now_ms() - start;
+        total += ms;
+        min = (!i || ms < min) ? ms : min;
+    }
+    printf("%s: %u symbols, build %d, %s\n", funcfile, t->count, t->build, t->os ? "windows" : "linux");
+    printf("  load          min %.3f ms, avg %.3f ms over %d runs\n", min, total / BENCH_RUNS, BENCH_RUNS);
+    if (!t->count) {
+        free_symtab(t);
+        return 0;
+    }
+
+    // Random offsets over the whole table, plus every function's boundaries
+    size_t n = BENCH_LOOKUPS, nall = n + 4 * (size_t)t->count;
+    uint32_t *offsets = xrealloc(NULL, nall * sizeof(uint32_t));
+    uint32_t span = t->offsets[t->count - 1] - t->offsets[0] + 0x1000;
+    uint64_t seed = 0x9E3779B97F4A7C15ull;
+    for (size_t i = 0; i < n; i++)
+        offsets[i] = t->offsets[0] - 0x100 + bench_random(&seed) % span;
+    double random = bench_lookups(t, offsets, n);
+    qsort(offsets, n, sizeof(uint32_t), u32cmp);
+    double sorted = bench_lookups(t, offsets, n);
+    printf("  lookup        %.1f M/s random, %.1f M/s sorted\n", random / 1e6, sorted / 1e6);
+
+    for (uint32_t i = 0; i < t->count; i++) {
+        offsets[n++] = t->offsets[i];
+        offsets[n++] = t->offsets[i] - 1;
+        offsets[n++] = t->ends[i];
+        offsets[n++] = t->ends[i] - 1;
+    }
+    qsort(offsets, n, sizeof(uint32_t), u32cmp);
+    size_t bad = bench_check(t, offsets, n);
+    printf("  check         %zu offsets, %zu mismatches against a linear search\n", n, bad);
+    free(offsets);
+
+    if (!t->os)
+        bench_decode(t, "linux", 0, &seed);
+    bench_decode(t, "raw", 1, &seed);
+    free_symtab(t);
+    return bad;
+}
+
+// --serve: answers decode requests on stdin/stdout, or on each connection to
+// a Unix socket, with the symbol tables loaded once up front. Requests are
+// single lines:
+//   decode BUILD linux|windows OFFSET...  one 'FUNCTION+0xDELTA' or '?' line
+//                                         per offset
+//   file PATH                             decode the crash log at PATH
+//   log N                                 decode the crash log in the next N lines
+//   ping
+// Each answer is 'OK N' followed by N lines, or a single 'ERR message' line.
+// Every request runs in a forked child which shares the loaded tables, so
+// one that dies (e.g. a log for a build with no functions file) only fails
+// that request.
+static void write_all(int fd, const char *buf, size_t len) {
+    while (len) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            exit(~0);
+        buf += n;
+        len -= n;
+    }
 }
 
+static void serve_reply(int fd, const char *out, size_t len) {
+    char header[32];
+    size_t lines = 0;
+    for (size_t i = 0; i < len; i++)
+        lines += out[i] == '\n';
+    int partial = len && out[len-1] != '\n';
+    write_all(fd, header, snprintf(header, sizeof(header), "OK %zu\n", lines + partial));
+    write_all(fd, out, len);
+    if (partial)
+        write_all(fd, "\n", 1);
+}
+
+#define serve_error(fd, msg) write_all(fd, "ERR " msg "\n", strlen("ERR " msg "\n"))
+
+// Runs one request, in the child process
+static void serve_request(int fd, char *request, char *body, size_t bodylen, struct symtab *symtab) {
+    char  *output = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&output, &size);
+    if (!out)
+        die("Out of memory");
+
+    char *arg = request + strcspn(request, " \t");
+    if (*arg)
+        *arg++ = '\0';
+    arg += strspn(arg, " \t");
+
+    if (!strcmp(request, "ping")) {
+        // Nothing to decode
+    } else if (!strcmp(request, "decode")) {
+        char *build = strtok(arg, " \t"), *os = strtok(NULL, " \t"), *offset;
+        if (!build || !os || (strcmp(os, "linux") && strcmp(os, "windows"))) {
+            serve_error(fd, "usage: decode BUILD linux|windows OFFSET...");
+            return;
+        }
+        int windows = !strcmp(os, "windows");
+        struct symtab *t = symtab ? symtab : get_symtab(atoi(build), windows);
+        if (symtab && (symtab->os != windows || (symtab->build && symtab->build != atoi(build)))) {
+            serve_error(fd, "build or OS does not match the functions file");
+            return;
+        }
+        if (!t) {
+            serve_error(fd, "unknown build");
+            return;
+        }
+        while ((offset = strtok(NULL, " \t"))) {
+            struct frame frame;
+            if (parse_frame(offset, strlen(offset), &frame) && (frame.idx = lookup(t, frame.offset)) != ~0u)
+                fprintf(out, "%s+0x%x\n", symbol_name(t, frame.idx), frame.offset - t->offsets[frame.idx]);
+            else
+                fprintf(out, "?\n");
+        }
+    } else if (!strcmp(request, "file") || !strcmp(request, "log")) {
+        FILE *in = NULL;
+        if (*request == 'f' && !(in = fopen(arg, "r"))) {
+            serve_error(fd, "unable to open file");
+            return;
+        }
+        if (*request == 'l' && bodylen && !(in = fmemopen(body, bodylen, "r")))
+            die("Out of memory");
+        if (in) {
+            decode_file(in, out, symtab, NULL);
+            fclose(in);
+        }
+    } else {
+        serve_error(fd, "unknown request");
+        return;
+    }
+
+    if (fclose(out))
+        die("Out of memory");
+    serve_reply(fd, output, size);
+    free(output);
+}
+
+// Reads requests from in and answers them on fd until EOF or 'quit'
+void serve(FILE *in, int fd, struct symtab *symtab) {
+    char  *line = NULL, *body = NULL;
+    size_t cap = 0, bodycap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &cap, in)) > 0) {
+        while (len && isspace((unsigned char)line[len-1]))
+            line[--len] = '\0';
+        if (!len)
+            continue;
+        if (!strcmp(line, "quit"))
+            break;
+
+        // A log's lines are read here, so the child gets the whole request
+        size_t bodylen = 0;
+        long nlines;
+        if (sscanf(line, "log %ld", &nlines) == 1) {
+            char  *l = NULL;
+            size_t lcap = 0;
+            ssize_t n;
+            while (nlines-- > 0 && (n = getline(&l, &lcap, in)) > 0) {
+                if (bodylen + n > bodycap) {
+                    bodycap = (bodylen + n) * 2;
+                    body = xrealloc(body, bodycap);
+                }
+                memcpy(body + bodylen, l, n);
+                bodylen += n;
+            }
+            free(l);
+        }
+
+        int status = 0;
+        pid_t pid = fork();
+        if (pid == 0) {
+            // exit() would otherwise seek the shared input back over what
+            // in has buffered, which the parent then reads again
+            if (fileno(in) != fd)
+                close(fileno(in));
+            serve_request(fd, line, body, bodylen, symtab);
+            exit(0);
+        }
+        if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+            serve_error(fd, "request failed");
+    }
+    free(line);
+    free(body);
+}
+
+// Accepts connections on a Unix socket at path, serving each in a child
+void serve_socket(const char *path, struct symtab *symtab) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path))
+        die("Socket path '%s' is too long", path);
+    strcpy(addr.sun_path, path);
+
+    int s = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+    if (s < 0 || bind(s, (struct sockaddr *)&addr, sizeof(addr)) || listen(s, 16))
+        die("Unable to listen on socket '%s'", path);
+    signal(SIGCHLD, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+
+    for (;;) {
+        int c = accept(s, NULL, NULL);
+        if (c < 0)
+            continue;
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(s);
+            signal(SIGCHLD, SIG_DFL);
+            FILE *in = fdopen(c, "r");
+            if (!in)
+                exit(~0);
+            serve(in, c, symtab);
+            exit(0);
+        }
+        close(c);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    struct symtab *symtab = NULL;
+
+    parse_cmdline(argc, argv);
+#ifdef DECODE_PROFILE
+    profile_pid = getpid();
+    atexit(profile_report);
+#endif
+    if (args.bench) {
+        static const char *const defaults[] = {
+            "extra/offsets/FunctionsLinux-8186.hpp",
+            "extra/offsets/FunctionsWindows-8186.hpp",
+        };
+        size_t bad = 0;
+        if (args.funcfile)
+            bad = bench(args.funcfile);
+        else
+            for (size_t i = 0; i < sizeof(defaults) / sizeof(defaults[0]); i++)
+                bad += bench(defaults[i]);
+        return bad ? 1 : 0;
+    }
+
+    if (!args.autodetect && !(symtab = load_functions(args.funcfile)))
+        exit(~0);
+
+    if (args.compile_index) {
+        char outfile[1024];
+        size_t len = strlen(args.funcfile);
+        if (ends_with(args.funcfile, ".hpp"))
+            len -= 4;
+        if (len + sizeof(".nwsym") > sizeof(outfile))
+            die("Functions file path too long");
+        memcpy(outfile, args.funcfile, len);
+        strcpy(outfile + len, ".nwsym");
+        write_index(symtab, outfile);
+        printf("Wrote %u symbols for build %d (%s) to %s\n", symtab->count, symtab->build,
+               symtab->os ? "windows" : "linux", outfile);
+        return 0;
+    }
+
+    struct symtab **tables = &symtab;
+    int ntables = 1;
+    if (args.all_builds) {
+        if (!load_all_builds(args.offsets_dir))
+            die("No Functions*-BUILD.hpp files found in '%s'", args.offsets_dir);
+        tables = all_symtabs(&ntables);
+        symtab = NULL;
+    }
+
+    if (args.serve) {
+        // Autodetect would load the tables in each request's child and then
+        // throw them away, so load every known build once here instead
+        if (args.autodetect && !args.all_builds && !load_all_builds(args.offsets_dir))
+            die("No Functions*-BUILD.hpp files found in '%s'", args.offsets_dir);
+        symcache_frozen = 1;
+        fflush(stdout);
+        if (args.socket)
+            serve_socket(args.socket, symtab);
+        else
+            serve(stdin, STDOUT_FILENO, symtab);
+        return 0;
+    }
+
+    if (args.diff) {
+        // Each build against the previous one for the same OS
+        for (int i = 1; i < ntables; i++) {
+            if (tables[i]->os == tables[i-1]->os)
+                diff_symtabs(tables[i-1], tables[i]);
+        }
+        return 0;
+    }
+
+    if (args.nresolve) {
+        int missing = 0;
+        for (int i = 0; i < args.nresolve; i++) {
+            if (strcmp(args.resolve[i], "-")) {
+                int found = 0;
+                for (int t = 0; t < ntables; t++)
+                    found += resolve(tables[t], args.resolve[i]);
+                if (!found && ++missing)
+                    fprintf(stderr, "No function matches '%s'\n", args.resolve[i]);
+                continue;
+            }
+            // Bulk queries, one name or pattern per line
+            struct reader r = { .f = stdin };
+            char  *line;
+            size_t len;
+            int    newline;
+            while ((line = read_line(&r, &len, &newline))) {
+                while (len && isspace((unsigned char)line[len-1]))
+                    line[--len] = '\0';
+                int found = 0;
+                for (int t = 0; t < ntables && len; t++)
+                    found += resolve(tables[t], line);
+                if (len && !found && ++missing)
+                    fprintf(stderr, "No function matches '%s'\n", line);
+            }
+            free(r.buf);
+        }
+        return missing ? 1 : 0;
+    }
+
+    struct aggregate aggregate = {0};
+    struct aggregate *agg = (args.aggregate || args.folded) ? &aggregate : NULL;
+    int failed = 0;
+
+    if (args.all_builds && !args.ndumpfiles) {
+        decode_all_builds(stdin, tables, ntables);
+    } else if (args.all_builds) {
+        for (int i = 0; i < args.ndumpfiles; i++) {
+            FILE *in = fopen(args.dumpfiles[i], "r");
+            if (!in) {
+                fprintf(stderr, "Unable to open input file '%s'\n", args.dumpfiles[i]);
+                failed++;
+                continue;
+            }
+            print_dumpfile_header(i);
+            fflush(stdout);
+            decode_all_builds(in, tables, ntables);
+            fclose(in);
+        }
+    } else if (!args.ndumpfiles) {
+        failed = decode_file(stdin, stdout, symtab, agg);
+    } else if (args.jobs > 1 && args.ndumpfiles > 1) {
+        failed = decode_parallel(symtab, agg);
+    } else {
+        for (int i = 0; i < args.ndumpfiles; i++) {
+            print_dumpfile_header(i);
+            failed += decode_dumpfile(args.dumpfiles[i], stdout, symtab, agg);
+        }
+    }
+
+    if (args.aggregate)
+        print_aggregate(agg);
+    if (args.folded)
+        print_folded(agg);
+
+    if (failed && args.ndumpfiles > 1)
+        fprintf(stderr, "%d of %d dump files could not be decoded\n", failed, args.ndumpfiles);
+    return failed ? 1 : 0;
+}